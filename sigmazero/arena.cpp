@@ -2,10 +2,14 @@
 #include <memory>
 
 #include <chess/chess.hpp>
+#include <c10/core/InferenceMode.h>
 
 #include "search.hpp"
 #include "sigmanet.hpp"
 #include "rules.hpp"
+#include "inference.hpp"
+#include "threading.hpp"
+#include "utility.hpp"
 
 
 int main(int argc, char** argv)
@@ -14,36 +18,30 @@ int main(int argc, char** argv)
     const int simulations = 2500;
     const auto value_function = material_value;
 
-    if(argc < 3)
+    arguments args(argc, argv);
+
+    if(args.positional.size() < 2)
     {
         std::cerr << "missing model paths" << std::endl;
         return 1;
     }
 
-    torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
-	torch::NoGradGuard no_grad;
-
-    sigmanet model_a = make_network();
-    sigmanet model_b = make_network();
+    configure_threads(thread_options(args));
 
-    torch::load(model_a, argv[1]);
-    torch::load(model_b, argv[2]);
+    torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
+	c10::InferenceMode inference_mode;
 
-	model_a->to(device);
-	model_a->eval();
-	model_a->zero_grad();
+    chess::init();
 
-	model_b->to(device);
-	model_b->eval();
-	model_b->zero_grad();
+    inference_options inference(args);
+    evaluator model_a = load_evaluator(args.positional[0], device, {1}, inference);
+    evaluator model_b = load_evaluator(args.positional[1], device, {1}, inference);
 
     float score_a = 0.0f;
     float score_b = 0.0f;
 
     chess::side seat = chess::side_white;
 
-    chess::init();
-
     for(int i = 0; i < games; i++)
     {
         chess::game game;
@@ -51,9 +49,9 @@ int main(int argc, char** argv)
         while(!game.is_terminal())
         {
             chess::side turn = game.get_position().get_turn();
-            sigmanet model = turn == seat ? model_a : model_b;
+            evaluator& model = turn == seat ? model_a : model_b;
             bool noise = game.size() == 0;
-            std::shared_ptr<node> best = run_mcts(game, model, device, stop_after(simulations), noise);
+            std::shared_ptr<node> best = run_mcts(game, model, stop_after(simulations), noise);
             chess::move move = best->move;
 
             game.push(move);
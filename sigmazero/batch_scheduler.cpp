@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <c10/core/InferenceMode.h>
+
+#include "batch_scheduler.hpp"
+#include "rules.hpp"
+
+
+task::task(std::coroutine_handle<promise_type> handle):
+handle(handle)
+{
+}
+
+task::~task()
+{
+    if(handle)
+    {
+        handle.destroy();
+    }
+}
+
+
+task::task(task&& other) noexcept:
+handle(std::exchange(other.handle, nullptr))
+{
+}
+
+task& task::operator=(task&& other) noexcept
+{
+    if(this != &other)
+    {
+        if(handle)
+        {
+            handle.destroy();
+        }
+
+        handle = std::exchange(other.handle, nullptr);
+    }
+
+    return *this;
+}
+
+
+bool task::done() const
+{
+    return handle.done();
+}
+
+
+void task::resume()
+{
+    handle.resume();
+}
+
+
+void task::rethrow() const
+{
+    if(handle.promise().error)
+    {
+        std::rethrow_exception(handle.promise().error);
+    }
+}
+
+
+bool batch_scheduler::evaluation_awaiter::await_ready() const noexcept
+{
+    return false;
+}
+
+
+void batch_scheduler::evaluation_awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->handle = handle;
+
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    scheduler.waiting.push_back(this);
+}
+
+
+position_evaluation batch_scheduler::evaluation_awaiter::await_resume()
+{
+    return std::move(result);
+}
+
+
+batch_scheduler::batch_scheduler(int batch_size, thread_pool& pool, bool pipelined, const thread_options& evaluation_threads):
+batch_size(batch_size),
+pool(pool)
+{
+    if(pipelined)
+    {
+        evaluation_thread = std::make_unique<job_thread>(evaluation_threads);
+    }
+}
+
+
+batch_scheduler::evaluation_awaiter batch_scheduler::evaluate(const std::uint8_t* image, bool root)
+{
+    return {*this, image, root, {}, {}};
+}
+
+
+void batch_scheduler::spawn(task coroutine)
+{
+    spawned.push_back(std::move(coroutine));
+}
+
+
+std::size_t batch_scheduler::size() const
+{
+    return tasks.size() + spawned.size();
+}
+
+
+int batch_scheduler::step(const evaluator& model, const moves_left_evaluator& moves_left)
+{
+    // new coroutines run to their first evaluation
+    if(!spawned.empty())
+    {
+        std::size_t first = tasks.size();
+        std::move(spawned.begin(), spawned.end(), std::back_inserter(tasks));
+        spawned.clear();
+
+        pool.parallel_for(tasks.size() - first, [&](int i)
+        {
+            c10::InferenceMode inference_mode;
+            tasks[first + i].resume();
+        });
+    }
+
+    std::vector<evaluation_awaiter*> evaluated;
+    std::vector<std::int64_t> evaluated_roots;
+    batch_result evaluation;
+
+    if(result.valid())
+    {
+        evaluation = result.get();
+        evaluated.swap(batch);
+        evaluated_roots.swap(roots);
+    }
+
+    // the next batch is evaluated while the coroutines of this one run, if there are enough waiting
+    bool launched = launch(model, moves_left);
+
+    for(std::size_t j = 0; j < evaluated.size(); j++)
+    {
+        evaluated[j]->result.value = evaluation.values[j];
+        evaluated[j]->result.policy = evaluation.policies[j];
+    }
+
+    if(evaluation.plies.defined())
+    {
+        for(std::size_t k = 0; k < evaluated_roots.size(); k++)
+        {
+            evaluated[evaluated_roots[k]]->result.plies = evaluation.plies[k].item<float>();
+        }
+    }
+
+    pool.parallel_for(evaluated.size(), [&](int j)
+    {
+        // inference mode is thread local
+        c10::InferenceMode inference_mode;
+        evaluated[j]->handle.resume();
+    });
+
+    if(!launched)
+    {
+        launch(model, moves_left);
+    }
+
+    // ended coroutines are dropped
+    auto ended = std::partition(tasks.begin(), tasks.end(), [](const task& coroutine) { return !coroutine.done(); });
+
+    for(auto it = ended; it != tasks.end(); it++)
+    {
+        it->rethrow();
+    }
+
+    tasks.erase(ended, tasks.end());
+
+    return evaluated.size();
+}
+
+
+bool batch_scheduler::launch(const evaluator& model, const moves_left_evaluator& moves_left)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::size_t count = std::min<std::size_t>(batch_size, waiting.size());
+        batch.assign(waiting.begin(), waiting.begin() + count);
+        waiting.erase(waiting.begin(), waiting.begin() + count);
+    }
+
+    if(batch.empty())
+    {
+        return false;
+    }
+
+    const int image_size = image_planes()*64;
+
+    torch::Tensor images = torch::empty({static_cast<std::int64_t>(batch.size()), image_planes(), 8, 8}, torch::kUInt8);
+    std::uint8_t* data = images.data_ptr<std::uint8_t>();
+
+    roots.clear();
+
+    for(std::size_t i = 0; i < batch.size(); i++)
+    {
+        std::memcpy(data + i*image_size, batch[i]->image, image_size);
+
+        if(batch[i]->root)
+        {
+            roots.push_back(i);
+        }
+    }
+
+    // the evaluators are copied, so that they can be replaced while the batch is evaluated
+    auto evaluate = [images, root_rows = roots, model, moves_left]()
+    {
+        c10::InferenceMode inference_mode;
+
+        batch_result evaluation;
+        std::tie(evaluation.values, evaluation.policies) = model(images);
+
+        if(moves_left && !root_rows.empty())
+        {
+            evaluation.plies = moves_left(images.index_select(0, torch::tensor(root_rows)));
+        }
+
+        return evaluation;
+    };
+
+    result = evaluation_thread ? evaluation_thread->submit(std::move(evaluate)) : std::async(std::launch::deferred, std::move(evaluate));
+
+    return true;
+}
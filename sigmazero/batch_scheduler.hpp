@@ -0,0 +1,146 @@
+#ifndef BATCH_SCHEDULER_HPP
+#define BATCH_SCHEDULER_HPP
+
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "inference.hpp"
+#include "thread_pool.hpp"
+#include "threading.hpp"
+
+
+// Coroutine that is started and resumed by a scheduler, and is suspended while it waits for evaluations.
+class task
+{
+public:
+    struct promise_type
+    {
+        std::exception_ptr error;
+
+        task get_return_object()
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            error = std::current_exception();
+        }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> handle);
+    ~task();
+
+    task(task&& other) noexcept;
+    task& operator=(task&& other) noexcept;
+
+    bool done() const;
+    void resume();
+
+    // Rethrow the exception the coroutine ended with, if any.
+    void rethrow() const;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+// Evaluation of a position, with the plies left predicted by the moves-left head for roots, or negative.
+struct position_evaluation
+{
+    torch::Tensor value, policy;
+    float plies = -1.0f;
+};
+
+
+// Runs coroutines on the threads of a pool and evaluates the positions they wait for in batches. A batch holds the
+// earliest waiting positions, up to the batch size, so that with more coroutines than the batch size batches stay full
+// while coroutines are running. Pipelined, a batch is evaluated on a thread of its own while the coroutines of the previous
+// batch run, with the options of the evaluation threads.
+class batch_scheduler
+{
+public:
+    struct evaluation_awaiter
+    {
+        batch_scheduler& scheduler;
+        const std::uint8_t* image;
+        bool root;
+
+        position_evaluation result;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const noexcept;
+        void await_suspend(std::coroutine_handle<> handle);
+        position_evaluation await_resume();
+    };
+
+    batch_scheduler(int batch_size, thread_pool& pool, bool pipelined = false, const thread_options& evaluation_threads = {});
+
+    batch_scheduler(const batch_scheduler&) = delete;
+    batch_scheduler& operator=(const batch_scheduler&) = delete;
+
+    // Wait for the evaluation of the image of a position. The image is read when the batch is formed, so it must stay
+    // unchanged while the coroutine waits.
+    evaluation_awaiter evaluate(const std::uint8_t* image, bool root = false);
+
+    // Start the coroutine in the next step.
+    void spawn(task coroutine);
+
+    // Evaluate a batch with the evaluators and resume the coroutines of the previous one. Returns the positions whose
+    // evaluations were handed out. The first exception a coroutine ended with is rethrown.
+    int step(const evaluator& model, const moves_left_evaluator& moves_left);
+
+    // coroutines that have not ended
+    std::size_t size() const;
+
+private:
+    struct batch_result
+    {
+        torch::Tensor values, policies, plies;
+    };
+
+    const int batch_size;
+    thread_pool& pool;
+
+    // thread that evaluates batches when pipelined, otherwise they are evaluated when their result is taken
+    std::unique_ptr<job_thread> evaluation_thread;
+
+    std::vector<task> tasks;
+    std::vector<task> spawned;
+
+    std::mutex mutex;
+    std::deque<evaluation_awaiter*> waiting;
+
+    // batch in evaluation, and the rows of its roots, which evaluates copies of the images and is destroyed first
+    std::vector<evaluation_awaiter*> batch;
+    std::vector<std::int64_t> roots;
+    std::future<batch_result> result;
+
+    bool launch(const evaluator& model, const moves_left_evaluator& moves_left);
+};
+
+
+#endif
@@ -0,0 +1,282 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <memory>
+#include <tuple>
+
+#include <chess/chess.hpp>
+#include <torch/torch.h>
+#include <c10/core/InferenceMode.h>
+
+#include "sigmanet.hpp"
+#include "rules.hpp"
+#include "inference.hpp"
+#include "utility.hpp"
+
+
+// Seconds per evaluation of the images, after warming up.
+static double time_evaluator(evaluator& evaluate, torch::Tensor images, int iterations)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        evaluate(images);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for(int i = 0; i < iterations; i++)
+    {
+        evaluate(images);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count() / iterations;
+}
+
+
+static void report(const std::string& name, int batch_size, double seconds)
+{
+    std::cout << std::setw(16) << std::left << name
+              << " batch " << std::setw(4) << batch_size
+              << std::fixed << std::setprecision(3) << std::setw(10) << std::right << seconds*1000.0 << " ms"
+              << std::setprecision(0) << std::setw(10) << batch_size/seconds << " positions/s" << std::endl;
+}
+
+
+// Compare the default NCHW layout of the eager network to channels-last and to the frozen TorchScript module.
+static void benchmark_layout(std::function<sigmanet()> make_model, torch::Device device, int iterations)
+{
+    c10::InferenceMode inference_mode;
+
+    for(int batch_size : {1, 64, 256})
+    {
+        torch::Tensor images = game_image(chess::game()).unsqueeze(0).repeat({batch_size, 1, 1, 1});
+        int batch_iterations = std::max(10, iterations / batch_size);
+
+        sigmanet contiguous = make_model();
+        contiguous->to(device);
+        contiguous->fold_batchnorm();
+        evaluator evaluate_contiguous = network_evaluator(contiguous, device);
+        report("nchw", batch_size, time_evaluator(evaluate_contiguous, images, batch_iterations));
+
+        sigmanet channels_last = make_model();
+        channels_last->to(device);
+        channels_last->fold_batchnorm();
+        channels_last->to_channels_last();
+        evaluator evaluate_channels_last = network_evaluator(channels_last, device);
+        report("channels-last", batch_size, time_evaluator(evaluate_channels_last, images, batch_iterations));
+
+        if(device.is_cpu())
+        {
+            evaluator evaluate_script = script_evaluator(script_network(make_model()), device);
+            report("script", batch_size, time_evaluator(evaluate_script, images, batch_iterations));
+        }
+    }
+}
+
+
+// Compare the hand-written kernels to libtorch on the CPU, and check that they agree.
+static void benchmark_simd(std::function<sigmanet()> make_model, int iterations)
+{
+    c10::InferenceMode inference_mode;
+
+    sigmanet model = make_model();
+    model->fold_batchnorm();
+
+    evaluator evaluate_network = network_evaluator(model, torch::kCPU);
+    evaluator evaluate_script = script_evaluator(script_network(make_model()), torch::kCPU);
+    evaluator evaluate_simd = simd_evaluator(std::make_shared<const simdnet>(simd_network(make_model())));
+
+    std::cerr << "simd kernels for " << simd_instruction_set() << std::endl;
+
+    for(int batch_size : {1, 16})
+    {
+        torch::Tensor images = game_image(chess::game()).unsqueeze(0).repeat({batch_size, 1, 1, 1});
+        int batch_iterations = std::max(10, iterations / batch_size);
+
+        report("network", batch_size, time_evaluator(evaluate_network, images, batch_iterations));
+        report("script", batch_size, time_evaluator(evaluate_script, images, batch_iterations));
+        report("simd", batch_size, time_evaluator(evaluate_simd, images, batch_iterations));
+    }
+
+    evaluation_error error = compare_evaluators(evaluate_network, evaluate_simd, check_images());
+    bool matches = error.value_mse <= simd_value_tolerance && error.policy_kl <= simd_policy_tolerance;
+
+    std::cout << "simd error: " << error.value_mse << " value mse, " << error.policy_kl << " policy kl, " << (matches ? "within" : "exceeds") << " tolerance" << std::endl;
+}
+
+
+// Multiply-adds for a position through the convolutions and linear layers of the module.
+static int64_t multiply_adds(torch::nn::Module& module)
+{
+    int64_t total = 0;
+
+    for(const std::shared_ptr<torch::nn::Module>& child: module.modules())
+    {
+        if(auto conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(child))
+        {
+            const auto& kernel_size = *conv->options.kernel_size();
+            total += 64 * conv->options.out_channels() * conv->options.in_channels()/conv->options.groups() * kernel_size[0]*kernel_size[1];
+        }
+        else if(auto linear = std::dynamic_pointer_cast<torch::nn::LinearImpl>(child))
+        {
+            total += linear->options.in_features() * linear->options.out_features();
+        }
+    }
+
+    return total;
+}
+
+
+// Compare the residual block types by size and forward latency, at the batch sizes of the engine and of selfplay.
+static void benchmark_blocks(torch::Device device, int filters, int blocks, int iterations)
+{
+    c10::InferenceMode inference_mode;
+
+    for(auto [name, type] : {std::make_pair("basic", block_type::basic), std::make_pair("bottleneck", block_type::bottleneck), std::make_pair("depthwise", block_type::depthwise)})
+    {
+        torch::manual_seed(0);
+        sigmanet model = make_network(2, filters, blocks, policy_head_type::linear, type);
+
+        int64_t parameters = 0;
+        for(const torch::Tensor& parameter: model->parameters())
+        {
+            parameters += parameter.numel();
+        }
+
+        int64_t block_flops = 2*multiply_adds(*model->named_modules()["residual.0"]);
+        int64_t network_flops = 2*multiply_adds(*model);
+
+        std::cout << name << ": " << parameters << " parameters, "
+                  << std::fixed << std::setprecision(1) << block_flops/1e6 << " mflops per block, "
+                  << network_flops/1e6 << " mflops per position" << std::endl;
+
+        model->to(device);
+        model->fold_batchnorm();
+        evaluator evaluate = network_evaluator(model, device);
+
+        for(int batch_size : {1, 64})
+        {
+            torch::Tensor images = game_image(chess::game()).unsqueeze(0).repeat({batch_size, 1, 1, 1});
+            report(name, batch_size, time_evaluator(evaluate, images, std::max(10, iterations / batch_size)));
+        }
+    }
+}
+
+
+// Compare training steps in fp32 and with bfloat16 autocast, on the same model and batches.
+static void benchmark_training(std::function<sigmanet()> make_model, torch::Device device, int iterations)
+{
+    const int batch_size = 128;
+    const int batches = 8;
+    const int steps = std::max(10, iterations / batch_size);
+
+    // random positions, outcomes and policies, the same for both runs
+    torch::manual_seed(0);
+    std::vector<torch::Tensor> images, values, policies;
+
+    for(int i = 0; i < batches; i++)
+    {
+        torch::Tensor image = game_image(chess::game());
+        images.push_back(image.unsqueeze(0).repeat({batch_size, 1, 1, 1}).to(device));
+        values.push_back((torch::rand({batch_size})*2.0f - 1.0f).to(device));
+        policies.push_back(torch::softmax(torch::randn({batch_size, num_actions}), -1).to(device));
+    }
+
+    for(bool bf16 : {false, true})
+    {
+        sigmanet model = make_model();
+        model->train();
+        model->to(device);
+
+        torch::optim::AdamW optimizer(model->parameters(), torch::optim::AdamWOptions().weight_decay(0.0001));
+
+        float running_loss = 0.0f;
+        auto start = std::chrono::steady_clock::now();
+
+        for(int step = 0; step < steps; step++)
+        {
+            int i = step % batches;
+
+            model->zero_grad();
+            torch::Tensor value, policy;
+            {
+                bf16_autocast autocast(bf16);
+                std::tie(value, policy) = model->forward(images[i]);
+            }
+
+            torch::Tensor loss = sigma_loss(value.to(torch::kFloat), values[i], policy.to(torch::kFloat), policies[i]);
+            loss.backward();
+            optimizer.step();
+
+            running_loss += loss.item<float>();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << std::setw(16) << std::left << (bf16 ? "bf16" : "fp32")
+                  << std::fixed << std::setprecision(2) << std::setw(10) << std::right << steps/elapsed.count() << " steps/s"
+                  << std::setprecision(4) << std::setw(12) << running_loss/(steps*batch_size) << " loss per position" << std::endl;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    arguments args(argc, argv);
+
+    if(args.positional.empty())
+    {
+        std::cerr << "usage: benchmark layout|simd|training|blocks [model path] [--cpu] [--iterations=N]" << std::endl;
+        return 1;
+    }
+
+    const std::string mode = args.positional[0];
+    const int iterations = args.get<int>("iterations", 2560);
+
+    torch::Device device(torch::cuda::is_available() && !args.has("cpu") ? torch::kCUDA : torch::kCPU);
+
+    chess::init();
+
+    // The same weights for every variant, either of a trained model or random.
+    std::function<sigmanet()> make_model = [&]()
+    {
+        if(args.positional.size() > 1)
+        {
+            return load_network(args.positional[1]);
+        }
+
+        torch::manual_seed(0);
+        return make_network(2, args.get<int>("filters", 128), args.get<int>("blocks", 10), policy_head_of(args.get<std::string>("policy-head", "linear")), block_type_of(args.get<std::string>("block", "basic")));
+    };
+
+    std::cerr << "benchmarking " << mode << " on " << device << std::endl;
+
+    if(mode == "layout")
+    {
+        benchmark_layout(make_model, device, iterations);
+    }
+    else if(mode == "simd")
+    {
+        benchmark_simd(make_model, iterations);
+    }
+    else if(mode == "training")
+    {
+        benchmark_training(make_model, device, iterations);
+    }
+    else if(mode == "blocks")
+    {
+        benchmark_blocks(device, args.get<int>("filters", 128), args.get<int>("blocks", 10), iterations);
+    }
+    else
+    {
+        std::cerr << "unknown benchmark " << mode << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,911 @@
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <cmath>
+
+#include <chess/chess.hpp>
+#include <c10/core/InferenceMode.h>
+#include <torch/csrc/jit/frontend/resolver.h>
+#include <torch/csrc/jit/frontend/sugared_value.h>
+
+#include "inference.hpp"
+#include "rules.hpp"
+
+
+inference_options::inference_options(const arguments& args):
+quantized{args.has("int8")},
+channels_last{args.has("channels-last")},
+simd{args.has("simd")}
+{
+
+}
+
+
+std::filesystem::path script_path(const std::filesystem::path& model_path)
+{
+    std::filesystem::path path = model_path;
+    return path.replace_extension(".script.pt");
+}
+
+std::filesystem::path quantized_path(const std::filesystem::path& model_path)
+{
+    std::filesystem::path path = model_path;
+    return path.replace_extension(".int8.pt");
+}
+
+std::filesystem::path weights_path(const std::filesystem::path& model_path)
+{
+    std::filesystem::path path = model_path;
+    return path.replace_extension(".weights");
+}
+
+std::filesystem::path manifest_path(const std::filesystem::path& model_path)
+{
+    std::filesystem::path path = model_path;
+    return path.replace_extension(".manifest");
+}
+
+
+// Resolves torch to aten as usual, and quantized to the quantized operators.
+struct quantized_resolver: torch::jit::Resolver
+{
+    std::shared_ptr<torch::jit::SugaredValue> resolveValue(const std::string& name, torch::jit::GraphFunction&, const torch::jit::SourceRange&) override
+    {
+        if(name == "torch" || name == "quantized")
+        {
+            return std::make_shared<torch::jit::BuiltinModule>(name == "torch" ? "aten" : name);
+        }
+
+        return nullptr;
+    }
+
+    torch::jit::TypePtr resolveType(const std::string&, const torch::jit::SourceRange&) override
+    {
+        return nullptr;
+    }
+};
+
+
+static const char* packing_source = R"(
+def pack_conv2d(self, weight: Tensor, bias: Optional[Tensor], stride: List[int], padding: List[int], dilation: List[int], groups: int):
+    return quantized.conv2d_prepack(weight, bias, stride, padding, dilation, groups)
+
+def pack_linear(self, weight: Tensor, bias: Optional[Tensor]):
+    return quantized.linear_prepack(weight, bias)
+)";
+
+
+// Builds the source of a TorchScript forward method from the layers of a folded network, registering the tensors it
+// uses as attributes of the module. When quantizing, the layers are also run on calibration images to observe the
+// ranges of the activations.
+struct script_builder
+{
+    torch::jit::Module& module;
+    std::ostringstream source;
+
+    // activations of x for the calibration images, only defined when quantizing
+    torch::Tensor calibration;
+    bool quantized = false;
+
+    void line(const std::string& code)
+    {
+        source << "    " << code << '\n';
+    }
+
+    void observe(std::function<torch::Tensor(torch::Tensor)> layer)
+    {
+        if(calibration.defined())
+        {
+            calibration = layer(calibration);
+        }
+    }
+
+    std::string constant(const std::string& name, torch::Tensor tensor)
+    {
+        module.register_buffer(name, tensor.detach().clone().contiguous());
+        return "self." + name;
+    }
+
+    std::string packed(const std::string& name, c10::IValue params)
+    {
+        module.register_attribute(name, params.type(), params);
+        return "self." + name;
+    }
+
+    // uint8 scale and zero point covering the observed range and zero
+    std::string range() const
+    {
+        float min = std::min(calibration.min().item<float>(), 0.0f);
+        float max = std::max(calibration.max().item<float>(), 0.0f);
+        float scale = std::max((max - min)/255.0f, std::numeric_limits<float>::epsilon());
+        int zero_point = std::clamp(static_cast<int>(std::round(-min/scale)), 0, 255);
+
+        std::ostringstream code;
+        code << std::setprecision(std::numeric_limits<float>::max_digits10) << scale << ", " << zero_point;
+        return code.str();
+    }
+
+    void quantize()
+    {
+        if(!quantized)
+        {
+            // dtypes are not resolved by name outside of python
+            line("x = torch.quantize_per_tensor(x, " + range() + ", " + std::to_string(static_cast<int>(torch::kQUInt8)) + ")");
+            quantized = true;
+        }
+    }
+
+    void dequantize()
+    {
+        if(quantized)
+        {
+            line("x = x.dequantize()");
+            quantized = false;
+        }
+    }
+
+    void conv(const std::string& name, torch::nn::Conv2dImpl& conv, bool relu, bool quantize_layer)
+    {
+        const auto& stride = *conv.options.stride();
+        const auto& kernel_size = *conv.options.kernel_size();
+        const auto& dilation = *conv.options.dilation();
+
+        // all convolutions of the network keep the size of the board
+        std::vector<int64_t> padding = {kernel_size[0]/2, kernel_size[1]/2};
+
+        if(quantize_layer)
+        {
+            // the input range is observed before the layer is run
+            quantize();
+        }
+        else
+        {
+            dequantize();
+        }
+
+        observe([&](torch::Tensor x)
+        {
+            x = conv.forward(x);
+            return relu ? torch::relu(x) : x;
+        });
+
+        if(quantize_layer)
+        {
+            c10::IValue params = module.run_method("pack_conv2d", quantize_weight(conv.weight), conv.bias.detach(), std::vector<int64_t>(stride.begin(), stride.end()), padding, std::vector<int64_t>(dilation.begin(), dilation.end()), conv.options.groups());
+            line("x = quantized." + std::string(relu ? "conv2d_relu" : "conv2d") + "(x, " + packed(name, params) + ", " + range() + ")");
+        }
+        else
+        {
+            std::ostringstream code;
+            code << "torch.conv2d(x, " << constant(name + "_weight", conv.weight) << ", " << constant(name + "_bias", conv.bias)
+                 << ", [" << stride[0] << ", " << stride[1] << "]"
+                 << ", [" << padding[0] << ", " << padding[1] << "]"
+                 << ", [" << dilation[0] << ", " << dilation[1] << "]"
+                 << ", " << conv.options.groups() << ")";
+
+            line("x = " + (relu ? "torch.relu(" + code.str() + ")" : code.str()));
+        }
+    }
+
+    void linear(const std::string& name, torch::nn::LinearImpl& linear, bool relu, bool quantize_layer)
+    {
+        if(quantize_layer)
+        {
+            quantize();
+        }
+        else
+        {
+            dequantize();
+        }
+
+        observe([&](torch::Tensor x)
+        {
+            x = linear.forward(x);
+            return relu ? torch::relu(x) : x;
+        });
+
+        if(quantize_layer)
+        {
+            c10::IValue params = module.run_method("pack_linear", quantize_weight(linear.weight), linear.bias.detach());
+            line("x = quantized." + std::string(relu ? "linear_relu" : "linear") + "(x, " + packed(name, params) + ", " + range() + ")");
+        }
+        else
+        {
+            std::string code = "torch.matmul(x, " + constant(name + "_weight", linear.weight.t()) + ") + " + constant(name + "_bias", linear.bias);
+            line("x = " + (relu ? "torch.relu(" + code + ")" : code));
+        }
+    }
+
+    // symmetric int8 weights, per output channel
+    static torch::Tensor quantize_weight(torch::Tensor weight)
+    {
+        weight = weight.detach();
+        torch::Tensor scales = weight.abs().flatten(1).amax(1).clamp_min(std::numeric_limits<float>::epsilon()) / 127.0f;
+        torch::Tensor zero_points = torch::zeros({weight.size(0)}, torch::kLong);
+
+        return torch::quantize_per_channel(weight, scales.to(torch::kDouble), zero_points, 0, torch::kQInt8);
+    }
+};
+
+
+static std::shared_ptr<torch::nn::Conv2dImpl> child_conv(torch::nn::Module& module, const std::string& name)
+{
+    auto conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(module.named_children()[name]);
+
+    if(!conv)
+    {
+        throw std::invalid_argument("missing convolution " + name + " of " + module.name());
+    }
+
+    return conv;
+}
+
+static std::shared_ptr<torch::nn::LinearImpl> child_linear(torch::nn::Module& module, const std::string& name)
+{
+    auto linear = std::dynamic_pointer_cast<torch::nn::LinearImpl>(module.named_children()[name]);
+
+    if(!linear)
+    {
+        throw std::invalid_argument("missing linear layer " + name + " of " + module.name());
+    }
+
+    return linear;
+}
+
+
+// The last convolution or linear layer of a head is kept in floating point when quantizing, as an output layer.
+static void script_sequential(script_builder& script, const std::string& name, torch::nn::Module& sequential, bool quantize, bool head = false)
+{
+    auto layers = sequential.named_children();
+    std::size_t last_output = layers.size();
+
+    for(std::size_t i = 0; head && i < layers.size(); i++)
+    {
+        if(std::dynamic_pointer_cast<torch::nn::LinearImpl>(layers[i].value()) || std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(layers[i].value()))
+        {
+            last_output = i;
+        }
+    }
+
+    for(std::size_t i = 0; i < layers.size(); i++)
+    {
+        const std::string layer_name = name + "_" + layers[i].key();
+        const std::shared_ptr<torch::nn::Module>& layer = layers[i].value();
+
+        // activations following convolutions and linear layers are fused into them
+        bool relu = i + 1 < layers.size() && std::dynamic_pointer_cast<torch::nn::ReLUImpl>(layers[i + 1].value());
+
+        if(auto conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(layer))
+        {
+            script.conv(layer_name, *conv, relu, quantize && i != last_output);
+            if(relu) i++;
+        }
+        else if(auto linear = std::dynamic_pointer_cast<torch::nn::LinearImpl>(layer))
+        {
+            script.linear(layer_name, *linear, relu, quantize && i != last_output);
+            if(relu) i++;
+        }
+        else if(auto flatten = std::dynamic_pointer_cast<torch::nn::FlattenImpl>(layer))
+        {
+            script.line("x = torch.flatten(x, " + std::to_string(flatten->options.start_dim()) + ", " + std::to_string(flatten->options.end_dim()) + ")");
+            script.observe([&](torch::Tensor x) { return flatten->forward(x); });
+        }
+        else if(std::dynamic_pointer_cast<torch::nn::ReLUImpl>(layer))
+        {
+            script.line("x = torch.relu(x)");
+            script.observe([](torch::Tensor x) { return torch::relu(x); });
+        }
+        else if(std::dynamic_pointer_cast<torch::nn::TanhImpl>(layer))
+        {
+            script.dequantize();
+            script.line("x = torch.tanh(x)");
+            script.observe([](torch::Tensor x) { return torch::tanh(x); });
+        }
+        else if(auto block = std::dynamic_pointer_cast<residual_block>(layer))
+        {
+            // batch normalization is folded into the convolutions
+            if(quantize) script.quantize();
+
+            script.line("r = x");
+            torch::Tensor residual = script.calibration;
+
+            const auto& block_layers = block->get_layers();
+
+            for(std::size_t j = 0; j < block_layers.size(); j++)
+            {
+                script.conv(layer_name + "_conv" + std::to_string(j + 1), *block_layers[j].conv, block_layers[j].relu, quantize);
+            }
+            script.observe([&](torch::Tensor x) { return torch::relu(x + residual); });
+
+            if(quantize)
+            {
+                script.line("x = quantized.add_relu(x, r, " + script.range() + ")");
+            }
+            else
+            {
+                script.line("x = torch.relu(x + r)");
+            }
+        }
+        else
+        {
+            throw std::invalid_argument("can not script layer " + layer->name());
+        }
+    }
+}
+
+
+static torch::jit::Module build_script(sigmanet model, torch::Tensor calibration_images)
+{
+    torch::NoGradGuard no_grad;
+
+    model->fold_batchnorm();
+    model->to(torch::kCPU);
+
+    auto children = model->named_children();
+    int channels = child_conv(*children["input_conv"], "0")->options.in_channels();
+    bool quantize = calibration_images.defined();
+
+    torch::jit::Module module("sigmanet");
+    script_builder script{module};
+
+    if(quantize)
+    {
+        module.define(packing_source, std::make_shared<quantized_resolver>());
+
+        torch::Tensor x = calibration_images.to(torch::kFloat);
+        script.calibration = x + count_plane_mask(channels)*(x.sum({-2, -1}, true) - x);
+    }
+
+    script.source << "def forward(self, x: Tensor) -> Tuple[Tensor, Tensor]:\n";
+    script.line("x = x.float()");
+    script.line("x = x + " + script.constant("count_mask", count_plane_mask(channels)) + " * (x.sum([-2, -1], True) - x)");
+
+    // the counts of the input have too wide a range to be quantized along with the bits
+    script_sequential(script, "input_conv", *children["input_conv"], false);
+    script_sequential(script, "residual", *children["residual"], quantize);
+
+    torch::Tensor tower = script.calibration;
+    bool tower_quantized = script.quantized;
+    script.line("h = x");
+
+    script_sequential(script, "value_head", *children["value_head"], quantize, true);
+    script.dequantize();
+    script.line("v = x");
+
+    script.line("x = h");
+    script.calibration = tower;
+    script.quantized = tower_quantized;
+
+    script_sequential(script, "policy_head", *children["policy_head"], quantize, true);
+    script.dequantize();
+
+    if(model->get_policy_type() == policy_head_type::convolutional)
+    {
+        script.line("x = torch.flatten(x.permute([0, 2, 3, 1]), 1)");
+    }
+    script.line("return v, x");
+
+    module.define(script.source.str(), std::make_shared<quantized_resolver>());
+    module.eval();
+
+    return torch::jit::freeze(module);
+}
+
+
+torch::jit::Module script_network(sigmanet model)
+{
+    torch::jit::Module frozen = build_script(model, torch::Tensor());
+    return torch::jit::optimize_for_inference(frozen);
+}
+
+
+torch::jit::Module quantize_network(sigmanet model, torch::Tensor calibration_images)
+{
+    return build_script(model, calibration_images);
+}
+
+
+static void save_atomically(torch::jit::Module module, const std::filesystem::path& path)
+{
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+
+    // readers never see a partially written module
+    module.save(temporary_path.string());
+    std::filesystem::rename(temporary_path, path);
+}
+
+
+void publish_script(const std::filesystem::path& model_path)
+{
+    sigmanet model = load_network(model_path);
+
+    save_atomically(script_network(model), script_path(model_path));
+}
+
+
+evaluation_error publish_quantized(const std::filesystem::path& model_path, torch::Tensor calibration_images, torch::Tensor check_images)
+{
+    sigmanet model = load_network(model_path);
+
+    torch::jit::Module module = quantize_network(model, calibration_images);
+    save_atomically(module, quantized_path(model_path));
+
+    return compare_evaluators(network_evaluator(model, torch::kCPU), script_evaluator(module, torch::kCPU), check_images);
+}
+
+
+void publish_weights(const std::filesystem::path& model_path)
+{
+    torch::NoGradGuard no_grad;
+
+    sigmanet model = load_network(model_path);
+    model->fold_batchnorm();
+    model->to(torch::kCPU);
+
+    weights_architecture architecture;
+    architecture.history = (model->get_channels() - constant_planes)/feature_planes;
+    architecture.channels = model->get_channels();
+    architecture.filters = model->get_filters();
+    architecture.blocks = model->get_blocks();
+    architecture.policy_head = static_cast<int>(model->get_policy_type());
+    architecture.block_type = static_cast<int>(model->get_block_type());
+    architecture.moves_left = model->has_moves_left();
+    architecture.widths = model->get_widths();
+
+    std::vector<torch::Tensor> contiguous;
+    std::vector<std::pair<std::string, weight_tensor>> tensors;
+
+    auto add = [&](const std::string& name, const torch::Tensor& tensor)
+    {
+        // counters of batch normalization are not needed for inference
+        if(!tensor.is_floating_point())
+        {
+            return;
+        }
+
+        contiguous.push_back(tensor.detach().to(torch::kFloat).contiguous());
+        tensors.emplace_back(name, weight_tensor{contiguous.back().sizes().vec(), contiguous.back().data_ptr<float>()});
+    };
+
+    for(const auto& item: model->named_parameters())
+    {
+        add(item.key(), item.value());
+    }
+
+    for(const auto& item: model->named_buffers())
+    {
+        add(item.key(), item.value());
+    }
+
+    write_weights(weights_path(model_path), architecture, tensors);
+}
+
+
+sigmanet map_network(const std::filesystem::path& path)
+{
+    auto weights = std::make_shared<const mapped_weights>(path);
+    const weights_architecture& architecture = weights->architecture();
+
+    sigmanet model = nullptr;
+
+    // the parameters are replaced by the mapping, so they are neither initialised nor folded
+    {
+        uninitialised_parameters uninitialised;
+        model = sigmanet(architecture.channels, architecture.filters, architecture.blocks, static_cast<policy_head_type>(architecture.policy_head), static_cast<block_type>(architecture.block_type), architecture.widths, architecture.moves_left != 0);
+    }
+
+    model->fold_batchnorm(false);
+
+    torch::NoGradGuard no_grad;
+
+    auto wrap = [&](const std::string& name, torch::Tensor tensor)
+    {
+        if(!tensor.is_floating_point())
+        {
+            return;
+        }
+
+        const weight_tensor& weight = weights->tensor(name);
+
+        if(tensor.sizes() != torch::IntArrayRef(weight.shape))
+        {
+            throw std::invalid_argument("shape of " + name + " in weight file does not match the architecture");
+        }
+
+        // the mapping lives as long as any tensor that wraps it
+        tensor.set_data(torch::from_blob(const_cast<float*>(weight.data), weight.shape, [weights](void*) {}, torch::kFloat));
+    };
+
+    for(const auto& item: model->named_parameters())
+    {
+        wrap(item.key(), item.value());
+    }
+
+    for(const auto& item: model->named_buffers())
+    {
+        wrap(item.key(), item.value());
+    }
+
+    return model;
+}
+
+
+evaluation_error compare_evaluators(evaluator reference, evaluator other, torch::Tensor images)
+{
+    c10::InferenceMode inference_mode;
+
+    auto [reference_values, reference_policies] = reference(images);
+    auto [values, policies] = other(images);
+
+    torch::Tensor reference_log_policies = torch::log_softmax(reference_policies, -1);
+    torch::Tensor log_policies = torch::log_softmax(policies, -1);
+
+    evaluation_error error;
+    error.value_mse = torch::mse_loss(values, reference_values).item<float>();
+    error.policy_kl = (reference_log_policies.exp()*(reference_log_policies - log_policies)).sum(-1).mean().item<float>();
+
+    return error;
+}
+
+
+torch::Tensor check_images(int count)
+{
+    chess::game game;
+    std::vector<torch::Tensor> images;
+
+    for(int ply = 0; ply < count && !game.get_moves().empty(); ply++)
+    {
+        images.push_back(game_image(game));
+
+        const std::vector<chess::move>& moves = game.get_moves();
+        chess::move move = moves[(ply*7) % moves.size()];
+        game.push(move);
+    }
+
+    return torch::stack(images);
+}
+
+
+evaluator network_evaluator(sigmanet model, torch::Device device)
+{
+    return [model, device](torch::Tensor images) mutable
+    {
+        auto [values, policies] = model->forward(images.to(device));
+        return std::make_pair(values.to(torch::kCPU), policies.to(torch::kCPU));
+    };
+}
+
+
+evaluator script_evaluator(torch::jit::Module module, torch::Device device)
+{
+    module.to(device);
+
+    return [module, device](torch::Tensor images) mutable
+    {
+        auto outputs = module.forward({images.to(device)}).toTuple();
+        return std::make_pair(outputs->elements()[0].toTensor().to(torch::kCPU), outputs->elements()[1].toTensor().to(torch::kCPU));
+    };
+}
+
+
+static std::vector<float> flat_values(torch::Tensor tensor)
+{
+    tensor = tensor.detach().to(torch::kCPU, torch::kFloat).contiguous();
+    return std::vector<float>(tensor.data_ptr<float>(), tensor.data_ptr<float>() + tensor.numel());
+}
+
+static simd_conv simd_convolution(torch::nn::Conv2dImpl& conv)
+{
+    simd_conv result;
+    result.in_channels = conv.options.in_channels();
+    result.out_channels = conv.options.out_channels();
+    result.kernel_size = (*conv.options.kernel_size())[0];
+    result.groups = conv.options.groups();
+
+    if(result.groups != 1 && (result.groups != result.in_channels || result.groups != result.out_channels))
+    {
+        throw std::invalid_argument("only depthwise grouped convolutions are supported by simdnet");
+    }
+
+    // [out, in, row, column] to [row, column, in, out], so that output channels are consecutive
+    result.weight = flat_values(conv.weight.permute({2, 3, 1, 0}));
+    result.bias = flat_values(conv.bias);
+
+    return result;
+}
+
+static simd_linear simd_affine(torch::nn::LinearImpl& linear)
+{
+    simd_linear result;
+    result.in_features = linear.options.in_features();
+    result.out_features = linear.options.out_features();
+    result.weight = flat_values(linear.weight.t());
+    result.bias = flat_values(linear.bias);
+
+    return result;
+}
+
+
+simdnet simd_network(sigmanet model)
+{
+    torch::NoGradGuard no_grad;
+
+    model->fold_batchnorm();
+    model->to(torch::kCPU);
+
+    auto children = model->named_children();
+    simdnet network;
+
+    network.input_conv = simd_convolution(*child_conv(*children["input_conv"], "0"));
+
+    for(const auto& child: children["residual"]->children())
+    {
+        simd_block block;
+
+        for(const residual_block::layer& layer: std::dynamic_pointer_cast<residual_block>(child)->get_layers())
+        {
+            block.layers.push_back({simd_convolution(*layer.conv), layer.relu});
+        }
+
+        network.residual.push_back(block);
+    }
+
+    // indices of the layers of the heads, which are kept when folding
+    network.value_conv = simd_convolution(*child_conv(*children["value_head"], "0"));
+    network.value_hidden = simd_affine(*child_linear(*children["value_head"], "4"));
+    network.value_output = simd_affine(*child_linear(*children["value_head"], "7"));
+
+    network.policy_conv = simd_convolution(*child_conv(*children["policy_head"], "0"));
+    network.convolutional_policy = model->get_policy_type() == policy_head_type::convolutional;
+
+    if(!network.convolutional_policy)
+    {
+        network.policy_output = simd_affine(*child_linear(*children["policy_head"], "4"));
+    }
+
+    for(float count: flat_values(count_plane_mask(network.input_conv.in_channels)))
+    {
+        network.count_planes.push_back(count != 0.0f);
+    }
+
+    return network;
+}
+
+
+evaluator simd_evaluator(std::shared_ptr<const simdnet> network)
+{
+    return [network](torch::Tensor images)
+    {
+        images = images.to(torch::kCPU, torch::kUInt8).contiguous();
+
+        const int64_t batch_size = images.size(0);
+        const int64_t image_size = images[0].numel();
+
+        torch::Tensor values = torch::empty({batch_size, 1});
+        torch::Tensor policies = torch::empty({batch_size, network->policy_size()});
+
+        for(int64_t i = 0; i < batch_size; i++)
+        {
+            values.data_ptr<float>()[i] = network->evaluate(images.data_ptr<std::uint8_t>() + i*image_size, policies[i].data_ptr<float>());
+        }
+
+        return std::make_pair(values, policies);
+    };
+}
+
+
+// Names of the files that the manifest of the model lists as published with it, which are none without a manifest.
+static std::set<std::string> published_files(const std::filesystem::path& model_path)
+{
+    std::set<std::string> files;
+    std::ifstream file(manifest_path(model_path));
+    std::string line;
+
+    // a manifest of another model lists nothing of this one
+    if(!std::getline(file, line) || line != model_path.filename().string())
+    {
+        return files;
+    }
+
+    while(std::getline(file, line))
+    {
+        if(!line.empty())
+        {
+            files.insert(line);
+        }
+    }
+
+    return files;
+}
+
+
+// Published module, if the manifest lists it.
+static std::optional<torch::jit::Module> load_published(const std::filesystem::path& path, const std::set<std::string>& published)
+{
+    if(published.count(path.filename().string()) == 0)
+    {
+        return std::nullopt;
+    }
+
+    try
+    {
+        torch::jit::Module module = torch::jit::load(path.string(), torch::kCPU);
+        std::cerr << "using published module " << path << std::endl;
+        return module;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "loading published module " << path << " failed" << std::endl;
+        return std::nullopt;
+    }
+}
+
+
+// Folded network of the model, mapped from its published weights if the manifest lists them.
+static sigmanet load_folded(const std::filesystem::path& model_path, const std::set<std::string>& published)
+{
+    std::filesystem::path path = weights_path(model_path);
+
+    if(published.count(path.filename().string()) != 0)
+    {
+        try
+        {
+            sigmanet model = map_network(path);
+            std::cerr << "using published weights " << path << std::endl;
+            return model;
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "mapping published weights " << path << " failed: " << e.what() << std::endl;
+        }
+    }
+
+    sigmanet model = load_network(model_path);
+    model->fold_batchnorm();
+
+    return model;
+}
+
+
+evaluator load_evaluator(const std::filesystem::path& model_path, torch::Device device, const std::vector<int>& batch_sizes, const inference_options& options)
+{
+    c10::InferenceMode inference_mode;
+
+    evaluator evaluate;
+
+    // the manifest is read once, so that all files come from the same publish
+    const std::set<std::string> published = published_files(model_path);
+
+    if(device.is_cpu() && options.simd)
+    {
+        sigmanet model = load_folded(model_path, published);
+        evaluator simd = simd_evaluator(std::make_shared<const simdnet>(simd_network(model)));
+
+        evaluation_error error = compare_evaluators(network_evaluator(model, torch::kCPU), simd, check_images());
+
+        if(error.value_mse <= simd_value_tolerance && error.policy_kl <= simd_policy_tolerance)
+        {
+            evaluate = simd;
+            std::cerr << "using simd kernels for " << simd_instruction_set() << std::endl;
+        }
+        else
+        {
+            // the folded network of libtorch is used instead
+            std::cerr << "simd kernels differ from the network by " << error.value_mse << " value mse, " << error.policy_kl << " policy kl, not using them" << std::endl;
+        }
+    }
+
+    // published modules are optimized for the CPU
+    if(device.is_cpu() && !evaluate)
+    {
+        std::optional<torch::jit::Module> module;
+
+        if(options.quantized)
+        {
+            module = load_published(quantized_path(model_path), published);
+        }
+
+        if(!module)
+        {
+            module = load_published(script_path(model_path), published);
+        }
+
+        if(module)
+        {
+            evaluate = script_evaluator(*module, device);
+        }
+    }
+
+    if(!evaluate)
+    {
+        sigmanet model = load_folded(model_path, published);
+        model->to(device);
+
+        if(options.channels_last)
+        {
+            model->to_channels_last();
+        }
+
+        evaluate = network_evaluator(model, device);
+    }
+
+    torch::Tensor image = game_image(chess::game());
+
+    for(int batch_size: batch_sizes)
+    {
+        // the profiling executor specializes the graph after a couple of runs
+        torch::Tensor images = image.unsqueeze(0).expand({batch_size, -1, -1, -1}).contiguous();
+        evaluate(images);
+        evaluate(images);
+    }
+
+    return evaluate;
+}
+
+
+moves_left_evaluator load_moves_left(const std::filesystem::path& model_path, torch::Device device)
+{
+    c10::InferenceMode inference_mode;
+
+    sigmanet model = load_folded(model_path, published_files(model_path));
+
+    if(!model->has_moves_left())
+    {
+        return {};
+    }
+
+    model->to(device);
+
+    return [model, device](torch::Tensor images) mutable
+    {
+        c10::InferenceMode inference_mode;
+        return model->moves_left(images.to(device)).to(torch::kCPU);
+    };
+}
+
+
+void publish_manifest(const std::filesystem::path& model_path)
+{
+    std::filesystem::path path = manifest_path(model_path);
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+
+    const std::filesystem::file_time_type model_time = std::filesystem::last_write_time(model_path);
+
+    {
+        std::ofstream file(temporary_path);
+        file << model_path.filename().string() << std::endl;
+
+        // files left from an earlier model, when publishing them failed, are not listed
+        for(const std::filesystem::path& published: {weights_path(model_path), script_path(model_path), quantized_path(model_path)})
+        {
+            if(std::filesystem::exists(published) && std::filesystem::last_write_time(published) >= model_time)
+            {
+                file << published.filename().string() << std::endl;
+            }
+        }
+
+        if(!file)
+        {
+            throw std::runtime_error("writing manifest " + temporary_path.string() + " failed");
+        }
+    }
+
+    std::filesystem::rename(temporary_path, path);
+}
+
+
+std::filesystem::file_time_type model_write_time(const std::filesystem::path& model_path)
+{
+    return std::filesystem::last_write_time(manifest_path(model_path));
+}
@@ -0,0 +1,126 @@
+#ifndef INFERENCE_HPP
+#define INFERENCE_HPP
+
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <torch/torch.h>
+#include <torch/script.h>
+
+#include "sigmanet.hpp"
+#include "simdnet.hpp"
+#include "weights.hpp"
+#include "utility.hpp"
+
+
+// Evaluate a batch of game images, returning values and policy logits on the CPU.
+using evaluator = std::function<std::pair<torch::Tensor, torch::Tensor>(torch::Tensor images)>;
+
+// Predict the plies remaining in the games of a batch of images, returning them on the CPU.
+using moves_left_evaluator = std::function<torch::Tensor(torch::Tensor images)>;
+
+
+struct inference_options
+{
+    // Use the int8 quantized module of the model, on the CPU.
+    bool quantized = false;
+
+    // Run the network in channels-last layout, when not using a published module.
+    bool channels_last = false;
+
+    // Evaluate with the hand-written kernels of simdnet on the CPU, which is faster than libtorch for single images.
+    bool simd = false;
+
+    inference_options() = default;
+    inference_options(const arguments& args);
+};
+
+
+// Path of the frozen TorchScript module that is published alongside a model.
+std::filesystem::path script_path(const std::filesystem::path& model_path);
+
+// Path of the int8 quantized TorchScript module that is published alongside a model.
+std::filesystem::path quantized_path(const std::filesystem::path& model_path);
+
+// Path of the flat weights of the folded network that are published alongside a model.
+std::filesystem::path weights_path(const std::filesystem::path& model_path);
+
+// Path of the manifest that is written after a model and the files published alongside it. Its first line names the
+// model and each further line a file published with it.
+std::filesystem::path manifest_path(const std::filesystem::path& model_path);
+
+
+// Fold the model at the path and save its weights next to it as a flat weight file, replacing any previous file atomically.
+void publish_weights(const std::filesystem::path& model_path);
+
+// Folded network of a weight file, with parameters that wrap the memory mapped file. The parameters are read-only.
+sigmanet map_network(const std::filesystem::path& path);
+
+
+// Script the network as a frozen TorchScript module optimized for inference. Batch normalization of the model is folded.
+torch::jit::Module script_network(sigmanet model);
+
+// Script the network with static int8 convolutions and linear layers, with activation ranges calibrated on the images.
+// The input convolution and the output layers of the heads are kept in floating point. Batch normalization of the model is folded.
+torch::jit::Module quantize_network(sigmanet model, torch::Tensor calibration_images);
+
+// Script the model at the path and save it next to it, replacing any previous module atomically.
+void publish_script(const std::filesystem::path& model_path);
+
+
+struct evaluation_error
+{
+    float value_mse;
+    float policy_kl;
+};
+
+// Quantize the model at the path and save it next to it, replacing any previous module atomically.
+// Returns the error of the quantized model with respect to the original on the check images.
+evaluation_error publish_quantized(const std::filesystem::path& model_path, torch::Tensor calibration_images, torch::Tensor check_images);
+
+// Mean squared error of values and mean Kullback-Leibler divergence of policies, from the reference to the other evaluator.
+evaluation_error compare_evaluators(evaluator reference, evaluator other, torch::Tensor images);
+
+// Images of the first positions of a game played by picking moves in a fixed pattern, to compare evaluators on.
+torch::Tensor check_images(int count = 32);
+
+// Largest errors of the simd kernels from the folded network that are accepted, since they only sum in another order.
+const float simd_value_tolerance = 1e-5f;
+const float simd_policy_tolerance = 1e-4f;
+
+
+evaluator network_evaluator(sigmanet model, torch::Device device);
+
+evaluator script_evaluator(torch::jit::Module module, torch::Device device);
+
+// Copy the weights of the network for the hand-written kernels. Batch normalization of the model is folded.
+simdnet simd_network(sigmanet model);
+
+// Evaluates the images of a batch one at a time.
+evaluator simd_evaluator(std::shared_ptr<const simdnet> network);
+
+// Load a model for inference. Only the published files that its manifest lists are loaded, so that they come from the
+// same publish as the model. The network is mapped from its published weights if they are listed.
+// With the simd option on the CPU, it is run by simdnet, unless its output differs from the folded network by more
+// than the tolerances on check images. Otherwise its scripted or quantized module is used if it is listed, which only is on the CPU.
+// The evaluator is warmed up with the batch sizes, to let TorchScript specialize for them.
+evaluator load_evaluator(const std::filesystem::path& model_path, torch::Device device, const std::vector<int>& batch_sizes = {}, const inference_options& options = {});
+
+// Load the moves-left head of a model, which is empty if the model has none. Published modules only have the value
+// and policy heads, so the folded network is run by libtorch.
+moves_left_evaluator load_moves_left(const std::filesystem::path& model_path, torch::Device device);
+
+// List the files published alongside the model that are up to date with it in its manifest, replacing any previous
+// manifest atomically. Call it after publishing the last of them, since loaders only use the files it lists.
+void publish_manifest(const std::filesystem::path& model_path);
+
+// Last time a model was published, as the write time of its manifest, to detect updates. Throws
+// std::filesystem::filesystem_error if it has no manifest.
+std::filesystem::file_time_type model_write_time(const std::filesystem::path& model_path);
+
+
+#endif
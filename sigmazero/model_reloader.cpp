@@ -0,0 +1,174 @@
+#include <chrono>
+#include <iostream>
+#include <utility>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "model_reloader.hpp"
+
+
+// manifests written in quick succession are loaded once
+static const int quiet_ms = 200;
+
+static const int poll_ms = 1000;
+static const int retry_ms = 1000;
+
+
+model_reloader::model_reloader(const std::filesystem::path& model_path, std::function<loaded_model()> load, const thread_options& threads):
+model_path(model_path),
+load(std::move(load))
+{
+    std::filesystem::path directory = model_path.parent_path();
+
+    if(directory.empty())
+    {
+        directory = ".";
+    }
+
+    inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // manifests are replaced by renaming, or may be written in place by hand
+    if(inotify >= 0 && inotify_add_watch(inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(inotify);
+        inotify = -1;
+    }
+
+    if(inotify < 0)
+    {
+        std::cerr << "watching model failed, polling it instead" << std::endl;
+
+        try
+        {
+            write_time = model_write_time(model_path);
+        }
+        catch(const std::filesystem::filesystem_error& e)
+        {
+        }
+    }
+
+    thread = std::thread(&model_reloader::run, this, threads);
+}
+
+model_reloader::~model_reloader()
+{
+    stopping = true;
+    thread.join();
+
+    if(inotify >= 0)
+    {
+        close(inotify);
+    }
+}
+
+
+std::optional<loaded_model> model_reloader::take()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::optional<loaded_model> model = std::move(loaded);
+    loaded.reset();
+
+    return model;
+}
+
+
+bool model_reloader::is_manifest(const std::string& name) const
+{
+    return manifest_path(model_path).filename() == name;
+}
+
+
+bool model_reloader::wait_for_change(int timeout_ms)
+{
+    if(inotify < 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+
+        try
+        {
+            std::filesystem::file_time_type time = model_write_time(model_path);
+            bool changed = time > write_time;
+            write_time = time;
+
+            return changed;
+        }
+        catch(const std::filesystem::filesystem_error& e)
+        {
+            return false;
+        }
+    }
+
+    pollfd descriptor = {inotify, POLLIN, 0};
+
+    if(poll(&descriptor, 1, timeout_ms) <= 0)
+    {
+        return false;
+    }
+
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t length;
+
+    while((length = read(inotify, buffer, sizeof(buffer))) > 0)
+    {
+        for(char* event_data = buffer; event_data < buffer + length;)
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(event_data);
+
+            if(event->len > 0 && is_manifest(event->name))
+            {
+                changed = true;
+            }
+
+            event_data += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+}
+
+
+void model_reloader::run(const thread_options& threads)
+{
+    configure_thread(threads);
+
+    bool pending = false;
+
+    while(!stopping)
+    {
+        if(wait_for_change(quiet_ms))
+        {
+            pending = true;
+            continue;
+        }
+
+        if(!pending)
+        {
+            continue;
+        }
+
+        try
+        {
+            auto start = std::chrono::steady_clock::now();
+            loaded_model model = load();
+            std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                loaded = std::move(model);
+            }
+
+            pending = false;
+            std::cerr << "loaded updated model in " << duration.count() << " s" << std::endl;
+        }
+        catch(const std::exception& e)
+        {
+            // the change is kept, and loaded again after a while
+            std::cerr << "loading updated model failed, retrying: " << e.what() << std::endl;
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+        }
+    }
+}
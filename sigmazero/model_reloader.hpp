@@ -0,0 +1,62 @@
+#ifndef MODEL_RELOADER_HPP
+#define MODEL_RELOADER_HPP
+
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "inference.hpp"
+#include "threading.hpp"
+
+
+// Evaluators of a model, loaded together.
+struct loaded_model
+{
+    evaluator model;
+    moves_left_evaluator moves_left;
+};
+
+
+// Thread that loads the model at the path again whenever its manifest is written, after the model and the files
+// published next to it, so that the caller can swap in the new evaluators between batches without waiting for the
+// load. Manifests are detected with inotify, or by polling their write time if it is not available. Loads that fail
+// are retried.
+class model_reloader
+{
+public:
+    // The function loads the evaluators and runs them once, so that they are ready when taken. It runs on a thread
+    // configured with the options, like the thread that evaluates batches.
+    model_reloader(const std::filesystem::path& model_path, std::function<loaded_model()> load, const thread_options& threads = {});
+    ~model_reloader();
+
+    model_reloader(const model_reloader&) = delete;
+    model_reloader& operator=(const model_reloader&) = delete;
+
+    // The model loaded after the last call, if any.
+    std::optional<loaded_model> take();
+
+private:
+    const std::filesystem::path model_path;
+    const std::function<loaded_model()> load;
+
+    std::mutex mutex;
+    std::optional<loaded_model> loaded;
+    std::atomic_bool stopping{false};
+
+    // inotify instance watching the directory of the model, or the last write time of the manifest when polling
+    int inotify = -1;
+    std::filesystem::file_time_type write_time;
+
+    std::thread thread;
+
+    bool is_manifest(const std::string& name) const;
+    bool wait_for_change(int timeout_ms);
+    void run(const thread_options& threads);
+};
+
+
+#endif
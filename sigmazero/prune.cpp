@@ -0,0 +1,300 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+
+#include <torch/torch.h>
+
+#include "sigmanet.hpp"
+#include "rules.hpp"
+#include "replay.hpp"
+#include "inference.hpp"
+#include "utility.hpp"
+
+
+// Channels between the convolutions of each block to keep, ranked by the magnitude of the batch normalization scale
+// after the first convolution. The threshold is shared by all blocks, so that blocks get narrower where they have the
+// most unimportant channels.
+static std::vector<torch::Tensor> rank_channels(sigmanet model, float keep, int min_width)
+{
+    torch::NoGradGuard no_grad;
+
+    auto parameters = model->named_parameters();
+    std::vector<torch::Tensor> scales;
+
+    for(int i = 0; i < model->get_blocks(); i++)
+    {
+        scales.push_back(parameters["residual." + std::to_string(i) + ".batchnorm1.weight"].abs().cpu());
+    }
+
+    torch::Tensor all_scales = torch::cat(scales);
+    int64_t kept_channels = std::clamp<int64_t>(std::llround(keep*all_scales.numel()), 1, all_scales.numel());
+    float threshold = std::get<0>(all_scales.topk(kept_channels)).min().item<float>();
+
+    std::vector<torch::Tensor> kept;
+
+    for(const torch::Tensor& block_scales: scales)
+    {
+        int64_t width = std::max<int64_t>((block_scales >= threshold).sum().item<int64_t>(), std::min<int64_t>(min_width, block_scales.numel()));
+        torch::Tensor indices = std::get<1>(block_scales.topk(width));
+
+        kept.push_back(std::get<0>(indices.sort()));
+    }
+
+    return kept;
+}
+
+
+// Copy the parameters and buffers of the model, selecting the kept channels between the convolutions of each block.
+static void copy_pruned(sigmanet model, sigmanet pruned, const std::vector<torch::Tensor>& kept)
+{
+    torch::NoGradGuard no_grad;
+
+    auto source_parameters = model->named_parameters();
+    auto source_buffers = model->named_buffers();
+
+    auto copy = [&](const std::string& name, torch::Tensor target, torch::Tensor source)
+    {
+        for(std::size_t i = 0; i < kept.size(); i++)
+        {
+            const std::string prefix = "residual." + std::to_string(i) + ".";
+
+            if(name.rfind(prefix, 0) != 0)
+            {
+                continue;
+            }
+
+            const std::string layer = name.substr(prefix.size());
+
+            if((layer.rfind("conv1.", 0) == 0 || layer.rfind("batchnorm1.", 0) == 0) && source.dim() > 0)
+            {
+                source = source.index_select(0, kept[i].to(source.device()));
+            }
+            else if(layer == "conv2.weight")
+            {
+                source = source.index_select(1, kept[i].to(source.device()));
+            }
+        }
+
+        target.copy_(source);
+    };
+
+    for(auto& item: pruned->named_parameters())
+    {
+        copy(item.key(), item.value(), source_parameters[item.key()]);
+    }
+
+    for(auto& item: pruned->named_buffers())
+    {
+        copy(item.key(), item.value(), source_buffers[item.key()]);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    const std::size_t window_size = 1 << 13;
+    const int64_t batch_size = 128;
+    const int log_steps = 256;
+    const long quantization_samples = 256;	// window positions to calibrate and check the quantized model with
+
+    arguments args(argc, argv);
+
+    // replay games are rendered by replaying their moves
+    chess::init();
+
+    if(args.positional.size() < 2)
+    {
+        std::cerr << "usage: prune <model path> <pruned model path> [replay files...] [--keep=0.5] [--min-width=16] [--steps=2048]" << std::endl;
+        return 1;
+    }
+
+    const std::string model_path = args.positional[0];
+    const std::string pruned_path = args.positional[1];
+
+    const float keep = args.get<float>("keep", 0.5f);
+    const int min_width = args.get<int>("min-width", 16);
+    const int steps = args.get<int>("steps", 2048);
+
+    sigmanet model = load_network(model_path);
+
+    if(model->get_block_type() != block_type::basic)
+    {
+        std::cerr << "only models of basic blocks can be pruned" << std::endl;
+        return 1;
+    }
+
+    std::vector<torch::Tensor> kept = rank_channels(model, keep, min_width);
+    std::vector<int> widths;
+
+    for(const torch::Tensor& indices: kept)
+    {
+        widths.push_back(indices.numel());
+    }
+
+    // the moves-left head is kept, and copied like the other heads
+    sigmanet pruned(model->get_channels(), model->get_filters(), model->get_blocks(), model->get_policy_type(), block_type::basic, widths, model->has_moves_left());
+    copy_pruned(model, pruned, kept);
+
+    std::cerr << "pruned widths:";
+    for(int width: widths) std::cerr << " " << width;
+    std::cerr << std::endl;
+
+    // fine-tune on the replay window
+    std::vector<replay_position> replays;
+
+    if(args.positional.size() > 2)
+    {
+        for(auto it = args.positional.begin() + 2; it != args.positional.end(); ++it)
+        {
+            std::ifstream file(*it);
+            std::vector<replay_position> file_replays = read_replays(file);
+            replays.insert(replays.end(), file_replays.begin(), file_replays.end());
+        }
+    }
+    else
+    {
+        replays = read_replays(std::cin);
+    }
+
+    if(replays.size() > window_size)
+    {
+        replays.erase(replays.begin(), replays.end() - window_size);
+    }
+
+    std::cerr << "fine-tuning on " << replays.size() << " positions" << std::endl;
+
+    torch::Tensor window_images;
+
+    if(!replays.empty())
+    {
+        std::vector<torch::Tensor> images;
+
+        for(const replay_position& replay: replays)
+        {
+            images.push_back(replay.image);
+        }
+
+        window_images = torch::stack(images);
+    }
+
+    if(!replays.empty() && steps > 0)
+    {
+        std::vector<torch::Tensor> values, policies, moves_left;
+
+        for(const replay_position& replay: replays)
+        {
+            values.push_back(replay.value);
+            policies.push_back(replay.policy);
+            moves_left.push_back(replay.moves_left);
+        }
+
+        torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
+
+        torch::Tensor device_images = window_images.to(device);
+        torch::Tensor window_values = torch::stack(values).to(device);
+        torch::Tensor window_policies = torch::stack(policies).to(device);
+        torch::Tensor window_moves_left = torch::stack(moves_left).to(device);
+
+        pruned->train();
+        pruned->to(device);
+
+        torch::optim::AdamW optimizer(pruned->parameters(), torch::optim::AdamWOptions().weight_decay(0.0001));
+        float running_loss = 0.0f;
+
+        for(int step = 1; step <= steps; step++)
+        {
+            torch::Tensor sample = torch::randint(device_images.size(0), {batch_size}, torch::TensorOptions(torch::kLong).device(device));
+            torch::Tensor sample_images = device_images.index({sample});
+
+            pruned->zero_grad();
+            torch::Tensor value, policy, moves_left;
+
+            // the moves-left head is trained along, so that it follows the retrained tower
+            if(pruned->has_moves_left())
+            {
+                std::tie(value, policy, moves_left) = pruned->forward_moves_left(sample_images);
+            }
+            else
+            {
+                std::tie(value, policy) = pruned->forward(sample_images);
+            }
+
+            torch::Tensor loss = sigma_loss(value, window_values.index({sample}), policy, window_policies.index({sample}));
+
+            if(moves_left.defined())
+            {
+                loss = loss + moves_left_loss(moves_left, window_moves_left.index({sample}));
+            }
+
+            loss.backward();
+            optimizer.step();
+
+            running_loss += loss.item<float>();
+
+            if(step % log_steps == 0)
+            {
+                std::cerr << "step " << step << ": " << running_loss/(log_steps*batch_size) << " average loss" << std::endl;
+                running_loss = 0.0f;
+            }
+        }
+
+        pruned->to(torch::kCPU);
+    }
+
+    save_network(pruned, pruned_path);
+    std::cerr << "saved pruned model " << pruned_path << std::endl;
+
+    // published in the same order as by the trainer, so that selfplay loads a pruned model like any other
+    try
+    {
+        publish_weights(pruned_path);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "saving weights of pruned model failed: " << e.what() << std::endl;
+    }
+
+    try
+    {
+        publish_script(pruned_path);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "scripting pruned model failed: " << e.what() << std::endl;
+    }
+
+    if(window_images.defined())
+    {
+        try
+        {
+            // calibrate and check on disjoint samples
+            using torch::indexing::Slice;
+            const long samples_per_part = std::min<long>(quantization_samples, window_images.size(0)/2);
+            torch::Tensor samples = torch::randperm(window_images.size(0)).index({Slice(0, 2*samples_per_part)});
+            torch::Tensor calibration_images = window_images.index({samples.index({Slice(0, samples_per_part)})});
+            torch::Tensor check_images = window_images.index({samples.index({Slice(samples_per_part)})});
+
+            evaluation_error error = publish_quantized(pruned_path, calibration_images, check_images);
+            std::cerr << "saved quantized pruned model: " << error.value_mse << " value mse, " << error.policy_kl << " policy kl" << std::endl;
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "quantizing pruned model failed: " << e.what() << std::endl;
+        }
+    }
+
+    try
+    {
+        publish_manifest(pruned_path);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "publishing pruned model failed: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
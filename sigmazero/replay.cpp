@@ -0,0 +1,558 @@
+#include <sstream>
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+
+#include "replay.hpp"
+#include "rules.hpp"
+#include "base64.hpp"
+
+
+static_assert(std::endian::native == std::endian::little, "replay frames are written in the byte order of the host");
+
+static const char frame_magic[4] = {'\0', 's', 'z', 'r'};
+static const std::uint16_t frame_version = 1;
+
+enum frame_kind : std::uint16_t
+{
+    position_frame = 0,
+    game_frame = 1
+};
+
+static const std::size_t frame_header_size = sizeof(frame_magic) + 2*sizeof(std::uint16_t) + 2*sizeof(std::uint32_t);
+
+// larger frames are corrupt, and are not read to memory
+static const std::uint32_t max_payload_size = 1 << 20;
+
+// set on a stream when skipping bytes that are not a frame read the magic of the next frame
+static const int magic_skipped_to = std::ios_base::xalloc();
+
+
+static std::uint32_t crc32(const std::uint8_t* data, std::size_t size)
+{
+    static const std::array<std::uint32_t, 256> table = []
+    {
+        std::array<std::uint32_t, 256> table;
+
+        for(std::uint32_t i = 0; i < 256; i++)
+        {
+            std::uint32_t c = i;
+
+            for(int k = 0; k < 8; k++)
+            {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+
+            table[i] = c;
+        }
+
+        return table;
+    }();
+
+    std::uint32_t crc = 0xffffffff;
+
+    for(std::size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xffffffff;
+}
+
+
+template<typename T>
+static void put(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Reads a value of a payload, checking that it is within the payload.
+template<typename T>
+static T get(const std::uint8_t*& position, const std::uint8_t* end)
+{
+    if(end - position < static_cast<std::ptrdiff_t>(sizeof(T)))
+    {
+        throw std::runtime_error("replay frame is truncated");
+    }
+
+    T value;
+    std::memcpy(&value, position, sizeof(T));
+    position += sizeof(T);
+
+    return value;
+}
+
+
+static std::string frame(frame_kind kind, const std::string& payload)
+{
+    std::string frame(frame_magic, sizeof(frame_magic));
+
+    put<std::uint16_t>(frame, frame_version);
+    put<std::uint16_t>(frame, kind);
+    put<std::uint32_t>(frame, payload.size());
+    put<std::uint32_t>(frame, crc32(reinterpret_cast<const std::uint8_t*>(payload.data()), payload.size()));
+
+    return frame + payload;
+}
+
+
+std::string encode_replay_frame(const replay_position& replay)
+{
+    torch::Tensor image = replay.image.to(torch::kCPU, torch::kUInt8).contiguous();
+    torch::Tensor policy = replay.policy.to(torch::kCPU, torch::kFloat).contiguous();
+
+    std::string payload;
+
+    put<std::uint16_t>(payload, image.size(0));
+    payload.append(reinterpret_cast<const char*>(image.data_ptr<std::uint8_t>()), image.numel());
+
+    put<float>(payload, replay.value.item<float>());
+    put<float>(payload, replay.moves_left.item<float>());
+
+    // visit distributions are zero except for the legal moves
+    const float* probabilities = policy.data_ptr<float>();
+    std::vector<std::uint16_t> actions;
+
+    for(std::int64_t action = 0; action < policy.numel(); action++)
+    {
+        if(probabilities[action] != 0.0f)
+        {
+            actions.push_back(action);
+        }
+    }
+
+    put<std::uint16_t>(payload, policy.numel());
+    put<std::uint16_t>(payload, actions.size());
+
+    for(std::uint16_t action: actions)
+    {
+        put<std::uint16_t>(payload, action);
+        put<float>(payload, probabilities[action]);
+    }
+
+    return frame(position_frame, payload);
+}
+
+std::string encode_replay_frame(const replay_game& game)
+{
+    std::string payload;
+
+    put<std::uint16_t>(payload, game.start_fen.size());
+    payload.append(game.start_fen);
+
+    std::string moves;
+
+    for(const chess::move& move: game.moves)
+    {
+        moves += move.to_lan() + ' ';
+    }
+
+    put<std::uint32_t>(payload, moves.size());
+    payload.append(moves);
+
+    put<std::uint16_t>(payload, num_actions);
+    put<std::uint16_t>(payload, game.positions.size());
+
+    for(std::size_t i = 0; i < game.positions.size(); i++)
+    {
+        const replay_position& replay = game.positions[i];
+        torch::Tensor policy = replay.policy.to(torch::kCPU, torch::kFloat).contiguous();
+        const float* probabilities = policy.data_ptr<float>();
+
+        put<std::uint16_t>(payload, game.plies[i]);
+        put<float>(payload, replay.value.item<float>());
+        put<float>(payload, replay.moves_left.item<float>());
+
+        // fractions of visits are quantized to 16 bits, and the policy is normalized again when decoded
+        std::vector<std::pair<std::uint16_t, std::uint16_t>> weights;
+
+        for(std::int64_t action = 0; action < policy.numel(); action++)
+        {
+            std::uint16_t weight = std::lround(std::clamp(probabilities[action], 0.0f, 1.0f)*65535.0f);
+
+            if(weight != 0)
+            {
+                weights.emplace_back(action, weight);
+            }
+        }
+
+        put<std::uint16_t>(payload, weights.size());
+
+        for(auto [action, weight]: weights)
+        {
+            put<std::uint16_t>(payload, action);
+            put<std::uint16_t>(payload, weight);
+        }
+    }
+
+    return frame(game_frame, payload);
+}
+
+
+void write_replay(std::ostream& stream, const replay_position& replay)
+{
+    const std::string frame = encode_replay_frame(replay);
+    stream.write(frame.data(), frame.size());
+}
+
+void write_replay(std::ostream& stream, const replay_game& game)
+{
+    const std::string frame = encode_replay_frame(game);
+    stream.write(frame.data(), frame.size());
+}
+
+
+static replay_position decode_payload(std::shared_ptr<std::vector<std::uint8_t>> buffer)
+{
+    const std::uint8_t* position = buffer->data();
+    const std::uint8_t* end = position + buffer->size();
+
+    replay_position replay;
+
+    std::int64_t planes = get<std::uint16_t>(position, end);
+
+    if(end - position < planes*64)
+    {
+        throw std::runtime_error("replay frame is truncated");
+    }
+
+    // the buffer lives as long as the image that wraps it
+    replay.image = torch::from_blob(const_cast<std::uint8_t*>(position), {planes, 8, 8}, [buffer](void*) {}, torch::kUInt8);
+    position += planes*64;
+
+    replay.value = torch::tensor(get<float>(position, end));
+    replay.moves_left = torch::tensor(get<float>(position, end));
+
+    std::int64_t actions = get<std::uint16_t>(position, end);
+    std::uint16_t nonzero = get<std::uint16_t>(position, end);
+
+    replay.policy = torch::zeros({actions});
+    float* probabilities = replay.policy.data_ptr<float>();
+
+    for(std::uint16_t i = 0; i < nonzero; i++)
+    {
+        std::uint16_t action = get<std::uint16_t>(position, end);
+        float probability = get<float>(position, end);
+
+        if(action >= actions)
+        {
+            throw std::runtime_error("replay frame has an action out of range");
+        }
+
+        probabilities[action] = probability;
+    }
+
+    return replay;
+}
+
+
+static replay_game decode_game(const std::vector<std::uint8_t>& buffer)
+{
+    const std::uint8_t* position = buffer.data();
+    const std::uint8_t* end = position + buffer.size();
+
+    auto string = [&](std::size_t size)
+    {
+        if(end - position < static_cast<std::ptrdiff_t>(size))
+        {
+            throw std::runtime_error("replay frame is truncated");
+        }
+
+        std::string value(reinterpret_cast<const char*>(position), size);
+        position += size;
+
+        return value;
+    };
+
+    replay_game game;
+    game.start_fen = string(get<std::uint16_t>(position, end));
+
+    std::istringstream moves(string(get<std::uint32_t>(position, end)));
+    std::string lan;
+
+    while(moves >> lan)
+    {
+        game.moves.push_back(chess::move::from_lan(lan));
+    }
+
+    std::int64_t actions = get<std::uint16_t>(position, end);
+    std::uint16_t count = get<std::uint16_t>(position, end);
+
+    for(std::uint16_t i = 0; i < count; i++)
+    {
+        replay_position replay;
+
+        game.plies.push_back(get<std::uint16_t>(position, end));
+        replay.value = torch::tensor(get<float>(position, end));
+        replay.moves_left = torch::tensor(get<float>(position, end));
+
+        replay.policy = torch::zeros({actions});
+        float* probabilities = replay.policy.data_ptr<float>();
+        float sum = 0.0f;
+
+        std::uint16_t nonzero = get<std::uint16_t>(position, end);
+
+        for(std::uint16_t j = 0; j < nonzero; j++)
+        {
+            std::uint16_t action = get<std::uint16_t>(position, end);
+            std::uint16_t weight = get<std::uint16_t>(position, end);
+
+            if(action >= actions)
+            {
+                throw std::runtime_error("replay frame has an action out of range");
+            }
+
+            probabilities[action] = weight;
+            sum += weight;
+        }
+
+        if(sum > 0.0f)
+        {
+            replay.policy /= sum;
+        }
+
+        game.positions.push_back(replay);
+    }
+
+    return game;
+}
+
+
+std::vector<replay_position> replay_positions(const replay_game& game)
+{
+    std::vector<replay_position> replays;
+    replays.reserve(game.positions.size());
+
+    chess::game replayed(chess::position::from_fen(game.start_fen), {});
+    std::size_t next = 0;
+
+    for(std::size_t ply = 0; ply <= game.moves.size() && next < game.positions.size(); ply++)
+    {
+        while(next < game.positions.size() && static_cast<std::size_t>(game.plies[next]) == ply)
+        {
+            replay_position replay = game.positions[next++];
+            replay.image = game_image(replayed);
+            replays.push_back(replay);
+        }
+
+        if(ply < game.moves.size())
+        {
+            replayed.push(game.moves[ply]);
+        }
+    }
+
+    if(next != game.positions.size())
+    {
+        throw std::runtime_error("replay game has positions out of order");
+    }
+
+    return replays;
+}
+
+
+// Skip bytes up to and including the next frame magic, continuing a match of the bytes that were read.
+static void skip_to_magic(std::istream& stream, const std::uint8_t* read, std::size_t read_size)
+{
+    std::size_t matched = 0;
+
+    auto match = [&](char c)
+    {
+        // the first byte of the magic does not occur again in it
+        matched = c == frame_magic[matched] ? matched + 1 : (c == frame_magic[0] ? 1 : 0);
+    };
+
+    for(std::size_t i = 1; i < read_size; i++)
+    {
+        match(static_cast<char>(read[i]));
+    }
+
+    int c;
+
+    while(matched < sizeof(frame_magic) && (c = stream.get()) != std::char_traits<char>::eof())
+    {
+        match(static_cast<char>(c));
+    }
+
+    if(matched == sizeof(frame_magic))
+    {
+        stream.iword(magic_skipped_to) = 1;
+    }
+}
+
+
+std::optional<replay_record> read_record(std::istream& stream)
+{
+    // the magic of this frame was read when skipping to it
+    const bool magic_read = stream.iword(magic_skipped_to) != 0;
+    stream.iword(magic_skipped_to) = 0;
+
+    if(!magic_read)
+    {
+        int first = stream.peek();
+
+        if(first == std::char_traits<char>::eof())
+        {
+            return std::nullopt;
+        }
+
+        // text lines of base64 never start with a zero byte
+        if(first != frame_magic[0])
+        {
+            std::string line;
+
+            if(!std::getline(stream, line))
+            {
+                return std::nullopt;
+            }
+
+            return decode_replay(line);
+        }
+
+        std::array<std::uint8_t, sizeof(frame_magic)> magic;
+
+        if(!stream.read(reinterpret_cast<char*>(magic.data()), magic.size()))
+        {
+            return std::nullopt;
+        }
+
+        if(std::memcmp(magic.data(), frame_magic, sizeof(frame_magic)) != 0)
+        {
+            skip_to_magic(stream, magic.data(), magic.size());
+            throw std::runtime_error("replay frame has no magic");
+        }
+    }
+
+    std::array<std::uint8_t, frame_header_size - sizeof(frame_magic)> header;
+
+    if(!stream.read(reinterpret_cast<char*>(header.data()), header.size()))
+    {
+        return std::nullopt;
+    }
+
+    const std::uint8_t* position = header.data();
+    const std::uint8_t* end = header.data() + header.size();
+
+    std::uint16_t version = get<std::uint16_t>(position, end);
+    std::uint16_t kind = get<std::uint16_t>(position, end);
+    std::uint32_t payload_size = get<std::uint32_t>(position, end);
+    std::uint32_t checksum = get<std::uint32_t>(position, end);
+
+    if(payload_size > max_payload_size)
+    {
+        stream.ignore(payload_size);
+        throw std::runtime_error("replay frame is too large");
+    }
+
+    auto buffer = std::make_shared<std::vector<std::uint8_t>>(payload_size);
+
+    if(!stream.read(reinterpret_cast<char*>(buffer->data()), payload_size))
+    {
+        return std::nullopt;
+    }
+
+    // the frame is skipped as a whole when it can not be decoded
+    if(version != frame_version)
+    {
+        throw std::runtime_error("unsupported replay frame version " + std::to_string(version));
+    }
+
+    if(crc32(buffer->data(), buffer->size()) != checksum)
+    {
+        throw std::runtime_error("replay frame checksum mismatch");
+    }
+
+    switch(kind)
+    {
+    case position_frame:
+        return decode_payload(buffer);
+    case game_frame:
+        return decode_game(*buffer);
+    default:
+        throw std::runtime_error("unknown replay frame kind " + std::to_string(kind));
+    }
+}
+
+
+static std::string encode(const torch::Tensor& tensor)
+{
+    std::ostringstream data;
+    torch::save(tensor, data);
+    return base64_encode(data.str());
+}
+
+static torch::Tensor decode(const std::string& data)
+{
+    torch::Tensor tensor;
+    std::istringstream stream(base64_decode(data));
+    torch::load(tensor, stream);
+    return tensor;
+}
+
+
+std::string encode_replay(const replay_position& replay)
+{
+    return encode(replay.image) + ' ' + encode(replay.value) + ' ' + encode(replay.policy) + ' ' + encode(replay.moves_left);
+}
+
+replay_position decode_replay(const std::string& line)
+{
+    std::string encoded_image, encoded_value, encoded_policy, encoded_moves_left;
+    std::istringstream(line) >> encoded_image >> encoded_value >> encoded_policy >> encoded_moves_left;
+
+    replay_position replay{decode(encoded_image), decode(encoded_value), decode(encoded_policy)};
+
+    // lines written before images were uint8 hold float planes with counts on every square
+    if(replay.image.is_floating_point())
+    {
+        replay.image = convert_float_image(replay.image);
+    }
+
+    if(!encoded_moves_left.empty())
+    {
+        replay.moves_left = decode(encoded_moves_left);
+    }
+
+    return replay;
+}
+
+
+std::vector<replay_position> read_replays(std::istream& stream)
+{
+    std::vector<replay_position> replays;
+
+    while(true)
+    {
+        try
+        {
+            std::optional<replay_record> record = read_record(stream);
+
+            if(!record)
+            {
+                break;
+            }
+
+            if(replay_position* replay = std::get_if<replay_position>(&*record))
+            {
+                replays.push_back(*replay);
+            }
+            else
+            {
+                std::vector<replay_position> game_replays = replay_positions(std::get<replay_game>(*record));
+                replays.insert(replays.end(), game_replays.begin(), game_replays.end());
+            }
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "exception raised when reading replay, ignoring it..." << std::endl;
+        }
+    }
+
+    return replays;
+}
@@ -0,0 +1,78 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <chess/chess.hpp>
+#include <torch/torch.h>
+
+
+// Position of a selfplay game, with the value and the visit distribution of the search as targets. The plies that
+// remained in the game are the target of the moves-left head, and negative if the game did not end by the rules.
+struct replay_position
+{
+    torch::Tensor image, value, policy;
+    torch::Tensor moves_left = torch::tensor(-1.0f);
+};
+
+
+// Selfplay game from a start position, with the targets of its searched positions and the plies from the start at
+// which they were searched. Their images are left out, since they can be rendered by replaying the moves.
+struct replay_game
+{
+    std::string start_fen;
+    std::vector<chess::move> moves;
+
+    std::vector<int> plies;
+    std::vector<replay_position> positions;
+};
+
+// Positions of the game with their images, rendered by replaying its moves. Throws std::runtime_error if the plies of
+// the positions are not increasing within the game.
+std::vector<replay_position> replay_positions(const replay_game& game);
+
+
+using replay_record = std::variant<replay_position, replay_game>;
+
+
+// Replays are framed binary records: a header of a zero byte and "szr", the version, kind and length of the payload as
+// little-endian integers and the CRC-32 of the payload, followed by the payload. The payload of a position holds the
+// image as raw uint8 planes, the value and remaining plies as floats, and the nonzero probabilities of the policy with
+// their actions. The payload of a game holds its start position and moves, and the targets of its positions with
+// probabilities quantized to 16 bits. Streams may also hold the older text lines of base64 encoded tensors, which never
+// start with a zero byte.
+
+
+// Frame of a replay position.
+std::string encode_replay_frame(const replay_position& replay);
+
+// Frame of a replay game.
+std::string encode_replay_frame(const replay_game& game);
+
+// Write the frame of a record to the stream.
+void write_replay(std::ostream& stream, const replay_position& replay);
+void write_replay(std::ostream& stream, const replay_game& game);
+
+// Read the next record of a stream of frames or text lines, or nothing at the end of the stream. The image of a
+// position wraps the buffer the frame was read to. Throws std::runtime_error if the record is corrupt, after skipping it,
+// or after skipping to the next frame if the frame has no magic.
+std::optional<replay_record> read_record(std::istream& stream);
+
+
+// Line of a replay stream, with the tensors of the position encoded in base64. Lines without remaining plies, as
+// written before they were, are decoded with them unknown, and float images of older lines are converted to uint8.
+std::string encode_replay(const replay_position& replay);
+
+replay_position decode_replay(const std::string& line);
+
+// Read positions until the end of the stream, replaying games and skipping records that can not be decoded.
+std::vector<replay_position> read_replays(std::istream& stream);
+
+
+#endif
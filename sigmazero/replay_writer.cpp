@@ -0,0 +1,99 @@
+#include <chrono>
+#include <utility>
+
+#include "replay_writer.hpp"
+
+
+replay_writer::replay_writer(std::ostream& stream, std::size_t capacity):
+stream(stream),
+capacity(capacity),
+thread(&replay_writer::run, this)
+{
+}
+
+replay_writer::~replay_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    condition.notify_one();
+    thread.join();
+}
+
+
+bool replay_writer::write(const std::string& records)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // the records being written count against the capacity, so that memory stays bounded while the stream blocks
+        if(buffer.size() + writing > 0 && buffer.size() + writing + records.size() > capacity)
+        {
+            stats.dropped++;
+            return false;
+        }
+
+        buffer.append(records);
+        stats.records++;
+    }
+
+    condition.notify_one();
+
+    return true;
+}
+
+
+replay_writer::statistics replay_writer::get_statistics()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+
+std::size_t replay_writer::pending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return buffer.size() + writing;
+}
+
+
+void replay_writer::run()
+{
+    std::string records;
+
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]{ return stopping || !buffer.empty(); });
+
+            if(buffer.empty())
+            {
+                return;
+            }
+
+            // swap buffers, so that records are queued while the previous ones are written
+            records.clear();
+            std::swap(records, buffer);
+            writing = records.size();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        stream.write(records.data(), records.size());
+        stream.flush();
+
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            writing = 0;
+            stats.writes++;
+            stats.bytes += records.size();
+            stats.write_seconds += duration.count();
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef REPLAY_WRITER_HPP
+#define REPLAY_WRITER_HPP
+
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+
+// Thread that writes records to a stream, so that a slow reader of the stream does not block the caller. Records are
+// gathered in a buffer of bounded size and written together, and records that do not fit are dropped.
+class replay_writer
+{
+public:
+    struct statistics
+    {
+        unsigned long records = 0;
+        unsigned long dropped = 0;
+        unsigned long writes = 0;
+        std::size_t bytes = 0;
+
+        // time spent writing to the stream, mostly waiting for the reader when it is a pipe
+        double write_seconds = 0.0;
+    };
+
+    replay_writer(std::ostream& stream, std::size_t capacity = 64 << 20);
+    ~replay_writer();
+
+    replay_writer(const replay_writer&) = delete;
+    replay_writer& operator=(const replay_writer&) = delete;
+
+    // Queue the records to be written without waiting, or drop them if the buffer is full. Returns whether they were
+    // queued.
+    bool write(const std::string& records);
+
+    statistics get_statistics();
+
+    // bytes queued and not yet written
+    std::size_t pending();
+
+private:
+    std::ostream& stream;
+    const std::size_t capacity;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::string buffer;
+    std::size_t writing = 0;
+    bool stopping = false;
+    statistics stats;
+
+    std::thread thread;
+
+    void run();
+};
+
+
+#endif
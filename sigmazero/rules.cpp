@@ -1,6 +1,8 @@
 #include <unordered_map>
 #include <array>
+#include <algorithm>
 #include <stdexcept>
+#include <cmath>
 
 #include "rules.hpp"
 
@@ -169,32 +171,64 @@ int move_action(chess::move move, const chess::game& game)
 }
 
 
-static torch::Tensor bitboard_plane(chess::bitboard bb)
+static void bitboard_plane(std::uint8_t* plane, chess::bitboard bb, bool flip)
 {
-    torch::Tensor plane = torch::zeros({8, 8});
-
     for(chess::square sq: chess::set_elements(bb))
     {
         int f = chess::file_of(sq);
         int r = chess::rank_of(sq);
 
-        using namespace torch::indexing;
-        plane.index_put_({r, f}, 1.0f);
+        if(flip) r = 7 - r;
+
+        plane[r*8 + f] = 1;
     }
+}
+
+
+static void constant_plane(std::uint8_t* plane, std::uint8_t value)
+{
+    std::fill_n(plane, 64, value);
+}
+
 
-    return plane;
+static void count_plane(std::uint8_t* plane, int count)
+{
+    // counts may not fit in a byte, so they are spread over the squares and summed by the network
+    for(int i = 0; i < 64 && count > 0; i++)
+    {
+        plane[i] = std::min(count, 255);
+        count -= plane[i];
+    }
 }
 
 
 torch::Tensor game_image(const chess::game& game, int history)
 {
-    using namespace torch::indexing;
+    torch::Tensor input = torch::empty({image_planes(history), 8, 8}, torch::kUInt8);
+    write_game_image(game, input.data_ptr<std::uint8_t>(), history);
+
+    return input;
+}
+
+
+int image_planes(int history)
+{
+    return feature_planes*history + constant_planes;
+}
 
+
+void write_game_image(const chess::game& game, std::uint8_t* data, int history)
+{
     chess::side p1 = game.get_position().get_turn();
     chess::side p2 = chess::opponent(p1);
 
-    const int planes = feature_planes*history + constant_planes;
-    torch::Tensor input = torch::zeros({planes, 8, 8});
+    // planes are only written where they are set
+    std::fill_n(data, image_planes(history)*64, 0);
+
+    auto plane = [data](int j)
+    {
+        return data + j*64;
+    };
 
     int j = 0;
 
@@ -212,34 +246,21 @@ torch::Tensor game_image(const chess::game& game, int history)
         for(int p = chess::piece_pawn; p <= chess::piece_king; p++)
         {
             chess::bitboard bb = b.piece_set(static_cast<chess::piece>(p), p1);
-            torch::Tensor plane = bitboard_plane(bb);
-            if(flip) plane = torch::flipud(plane);
-
-            input.index_put_({j++}, plane);
+            bitboard_plane(plane(j++), bb, flip);
         }
 
         // p2 pieces
         for(int p = chess::piece_pawn; p <= chess::piece_king; p++)
         {
             chess::bitboard bb = b.piece_set(static_cast<chess::piece>(p), p2);
-            torch::Tensor plane = bitboard_plane(bb);
-            if(flip) plane = torch::flipud(plane);
-
-            input.index_put_({j++}, plane);
+            bitboard_plane(plane(j++), bb, flip);
         }
 
         // repetitions
         int repetitions = g.get_repetitions();
 
-        if(repetitions >= 1)
-        {
-            input.index_put_({j}, torch::ones({8, 8}));
-        } j++;
-
-        if(repetitions >= 2)
-        {
-            input.index_put_({j}, torch::ones({8, 8}));
-        } j++;
+        constant_plane(plane(j++), repetitions >= 1);
+        constant_plane(plane(j++), repetitions >= 2);
 
         // previous position (if not at initial, in which case the loop will end)
         if(!g.empty())
@@ -254,29 +275,55 @@ torch::Tensor game_image(const chess::game& game, int history)
     const chess::position& position = game.get_position();
 
     // color
-    input.index_put_({j++}, static_cast<int>(p1));
+    constant_plane(plane(j++), static_cast<int>(p1));
 
     // move count
-    input.index_put_({j++}, position.get_fullmove());
+    count_plane(plane(j++), position.get_fullmove());
 
     // p1 castling
-    input.index_put_({j++}, position.can_castle_kingside(p1));
-    input.index_put_({j++}, position.can_castle_queenside(p1));
+    constant_plane(plane(j++), position.can_castle_kingside(p1));
+    constant_plane(plane(j++), position.can_castle_queenside(p1));
 
     // p2 castling
-    input.index_put_({j++}, position.can_castle_kingside(p2));
-    input.index_put_({j++}, position.can_castle_queenside(p2));
+    constant_plane(plane(j++), position.can_castle_kingside(p2));
+    constant_plane(plane(j++), position.can_castle_queenside(p2));
 
     // no-progress count
-    input.index_put_({j++}, position.get_halfmove_clock());
+    count_plane(plane(j++), position.get_halfmove_clock());
+}
 
-    return input;
+torch::Tensor count_plane_mask(int channels)
+{
+    torch::Tensor mask = torch::zeros({channels, 1, 1});
+
+    mask.index_put_({channels - constant_planes + color_planes}, 1.0f);
+    mask.index_put_({channels - no_progress_planes}, 1.0f);
+
+    return mask;
+}
+
+torch::Tensor convert_float_image(torch::Tensor image)
+{
+    const int channels = image.size(0);
+
+    // the other planes are binary
+    torch::Tensor converted = image.to(torch::kUInt8).contiguous();
+    std::uint8_t* data = converted.data_ptr<std::uint8_t>();
+
+    for(int j: {channels - constant_planes + color_planes, channels - no_progress_planes})
+    {
+        int count = std::lround(image[j][0][0].item<float>());
+
+        constant_plane(data + j*64, 0);
+        count_plane(data + j*64, count);
+    }
 
+    return converted;
 }
 
-sigmanet make_network(int history, int filters, int blocks)
+sigmanet make_network(int history, int filters, int blocks, policy_head_type policy_type, block_type residual_type, bool moves_left)
 {
-    return sigmanet(feature_planes*history + constant_planes, filters, blocks);
+    return sigmanet(image_planes(history), filters, blocks, policy_type, residual_type, {}, moves_left);
 }
 
 
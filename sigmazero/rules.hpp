@@ -39,9 +39,23 @@ const int num_actions = 64*actions_per_square;
 
 int move_action(chess::move move, const chess::game& game);
 
+// Binary uint8 planes, except for the move and no-progress counts which are spread over the squares of their planes.
 torch::Tensor game_image(const chess::game& game, int history = 2);
 
-sigmanet make_network(int history = 2, int filters = 128, int blocks = 10);
+// Planes of the images made by game_image.
+int image_planes(int history = 2);
+
+// Write the image of the game as made by game_image to image_planes*64 bytes, such as a slot of a batch.
+void write_game_image(const chess::game& game, std::uint8_t* data, int history = 2);
+
+// Mask of the planes of an image that game_image spreads counts over, shaped to broadcast over images.
+torch::Tensor count_plane_mask(int channels);
+
+// Image made by game_image of the same position as an image of float planes with the counts on every square of their
+// planes, as images were made before they were uint8.
+torch::Tensor convert_float_image(torch::Tensor image);
+
+sigmanet make_network(int history = 2, int filters = 128, int blocks = 10, policy_head_type policy_type = policy_head_type::linear, block_type residual_type = block_type::basic, bool moves_left = false);
 
 
 float material_value(const chess::game& game, chess::side side = chess::side_white);
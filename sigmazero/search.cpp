@@ -1,4 +1,8 @@
 #include <limits>
+#include <algorithm>
+#include <cmath>
+
+#include <c10/core/InferenceMode.h>
 
 #include "search.hpp"
 #include "utility.hpp"
@@ -27,14 +31,13 @@ void node::expand(const chess::game& game, const torch::Tensor policy)
     turn = game.get_position().get_turn();
 
     const std::vector<chess::move>& legal_moves = game.get_moves();
-    
-    float policy_sum = 0.0f;
-    torch::Tensor policy_exp = torch::exp(policy);
 
-    for(chess::move move: legal_moves)
-    {
-        policy_sum += policy_exp.index({move_action(move, game)}).item<float>();
-    }
+    // logits are read directly, tensor operations for each move would dominate the time spent in the tree
+    torch::Tensor logits = policy.to(torch::kCPU, torch::kFloat).contiguous();
+    const float* logit = logits.data_ptr<float>();
+
+    float max_logit = -std::numeric_limits<float>::infinity();
+    children.reserve(legal_moves.size());
 
     for(chess::move move: legal_moves)
     {
@@ -43,10 +46,24 @@ void node::expand(const chess::game& game, const torch::Tensor policy)
         child->action = move_action(move, game);
         child->move = move;
         child->turn = chess::opponent(turn);
-        child->prior = policy_exp.index({child->action}).item<float>()/policy_sum;
 
+        max_logit = std::max(max_logit, logit[child->action]);
         children.push_back(child);
     }
+
+    // softmax over the legal moves, shifted by the largest logit to not overflow
+    float policy_sum = 0.0f;
+
+    for(std::shared_ptr<node> child: children)
+    {
+        child->prior = std::exp(logit[child->action] - max_logit);
+        policy_sum += child->prior;
+    }
+
+    for(std::shared_ptr<node> child: children)
+    {
+        child->prior /= policy_sum;
+    }
 }
 
 
@@ -119,14 +136,13 @@ float ucb_score(const node& parent, const node& child, float pb_c_base, float pb
 }
 
 
-void add_exploration_noise(node& root, float dirichlet_alpha, float exploration_fraction)
+void add_exploration_noise(node& root, std::mt19937& generator, float dirichlet_alpha, float exploration_fraction)
 {
-    std::mt19937& rand_engine = get_generator();
     std::gamma_distribution<float> gamma_dist(dirichlet_alpha, 1.0f);
 
     for(std::shared_ptr<node> child: root.children)
     {
-        float noise = gamma_dist(rand_engine);
+        float noise = gamma_dist(generator);
         child->prior = child->prior*(1 - exploration_fraction) + noise*exploration_fraction;
     }
 }
@@ -149,10 +165,12 @@ std::pair<std::vector<std::shared_ptr<node>>, chess::game> traverse(std::shared_
 
 void backpropagate(std::vector<std::shared_ptr<node>>& search_path, const torch::Tensor value, chess::side turn)
 {
+    const float v = value.item<float>();
+
     for(std::shared_ptr<node> node: search_path)
     {
-        //node->value_sum += node->turn == turn ? value.item<float>() : (1.0f - value.item<float>());
-        node->value_sum += node->turn == turn ? value.item<float>() : -value.item<float>();
+        //node->value_sum += node->turn == turn ? v : (1.0f - v);
+        node->value_sum += node->turn == turn ? v : -v;
         node->visit_count += 1;
     }
 }
@@ -171,8 +189,11 @@ bool stop_after::operator()(const node&)
 
 
 
-std::shared_ptr<node> run_mcts(const chess::game& game, sigmanet network, torch::Device device, stop_cond stop, bool noise, std::optional<std::shared_ptr<node>> last_best)
+std::shared_ptr<node> run_mcts(const chess::game& game, evaluator evaluate, stop_cond stop, bool noise, std::optional<std::shared_ptr<node>> last_best)
 {
+    // thread local, and the search may run in another thread than the model was loaded in
+    c10::InferenceMode inference_mode;
+
     auto root = std::make_shared<node>();
 
     if(last_best)
@@ -181,7 +202,7 @@ std::shared_ptr<node> run_mcts(const chess::game& game, sigmanet network, torch:
     }
 
     auto image = game_image(game);
-    auto [value, policy] = network->forward(image.unsqueeze(0).to(device));
+    auto [value, policy] = evaluate(image.unsqueeze(0));
 
     if(!root->expanded())
     {
@@ -208,7 +229,7 @@ std::shared_ptr<node> run_mcts(const chess::game& game, sigmanet network, torch:
         else
         {
             image = game_image(scratch_game);
-            auto [value, policy] = network->forward(image.unsqueeze(0).to(device));
+            auto [value, policy] = evaluate(image.unsqueeze(0));
             leaf->expand(scratch_game, policy.squeeze());
             backpropagate(search_path, value.squeeze(), scratch_game.get_position().get_turn());
         }
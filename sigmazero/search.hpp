@@ -7,11 +7,14 @@
 #include <vector>
 #include <functional>
 #include <optional>
+#include <random>
 
 #include <chess/chess.hpp>
 #include <torch/torch.h>
 
 #include "sigmanet.hpp"
+#include "inference.hpp"
+#include "utility.hpp"
 
 
 struct node
@@ -39,7 +42,7 @@ struct node
 
 
 float ucb_score(const node& parent, const node& child, float pb_c_base = 19652, float pb_c_init = 1.25);
-void add_exploration_noise(node& root, float dirichlet_alpha = 0.3f, float exploration_fraction = 0.25f);
+void add_exploration_noise(node& root, std::mt19937& generator = get_generator(), float dirichlet_alpha = 0.3f, float exploration_fraction = 0.25f);
 
 std::pair<std::vector<std::shared_ptr<node>>, chess::game> traverse(std::shared_ptr<node> root, const chess::game& game);
 void backpropagate(std::vector<std::shared_ptr<node>>& search_path, const torch::Tensor value, chess::side turn);
@@ -56,7 +59,7 @@ struct stop_after
     bool operator()(const node&);
 };
 
-std::shared_ptr<node> run_mcts(const chess::game& game, sigmanet network, torch::Device device, stop_cond stop, bool noise = false, std::optional<std::shared_ptr<node>> last_best = std::nullopt);
+std::shared_ptr<node> run_mcts(const chess::game& game, evaluator evaluate, stop_cond stop, bool noise = false, std::optional<std::shared_ptr<node>> last_best = std::nullopt);
 
 
 #endif
\ No newline at end of file
@@ -8,29 +8,40 @@
 #include <memory>
 #include <cstdint>
 #include <functional>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <optional>
+#include <cmath>
+#include <tuple>
+
+#include <unistd.h>
 
 #include <chess/chess.hpp>
 #include <torch/torch.h>
+#include <c10/core/InferenceMode.h>
+#include <ATen/Parallel.h>
 
 #include "rules.hpp"
 #include "sigmanet.hpp"
 #include "search.hpp"
-#include "base64.hpp"
+#include "inference.hpp"
+#include "replay.hpp"
+#include "replay_writer.hpp"
+#include "model_reloader.hpp"
+#include "threading.hpp"
+#include "thread_pool.hpp"
+#include "batch_scheduler.hpp"
 #include "utility.hpp"
 
 
-static std::string encode(const torch::Tensor &tensor)
-{
-	std::ostringstream data;
-	torch::save(tensor, data);
-	return base64_encode(data.str());
-}
-
 struct worker
 {
 	std::shared_ptr<node> root;
-	chess::game game = chess::game(chess::position::from_fen("1k1r4/pp4p1/1n4p1/2p3Pp/2P3n1/1P3NP1/P4PB1/1K2R3 b - - 0 31"), {}); // Kasparov vs. Deep Blue
-	//chess::game game = chess::game(chess::position::from_fen("ppppk3/ppppppp1/ppppppp1/ppppppp1/8/8/PPPPPPPN/PPPPKPPR w K - 0 1"), {});
+	std::string start_fen = "1k1r4/pp4p1/1n4p1/2p3Pp/2P3n1/1P3NP1/P4PB1/1K2R3 b - - 0 31"; // Kasparov vs. Deep Blue
+	//std::string start_fen = "ppppk3/ppppppp1/ppppppp1/ppppppp1/8/8/PPPPPPPN/PPPPKPPR w K - 0 1";
+	chess::game game = chess::game(chess::position::from_fen(start_fen), {});
 
 	chess::game scratch_game;
 	std::vector<std::shared_ptr<node>> search_path;
@@ -39,23 +50,67 @@ struct worker
 	std::vector<torch::Tensor> visits;
 	std::vector<torch::Tensor> values;
 	std::vector<chess::side> turns;
+	std::vector<std::size_t> plies;
+
+	bool adjudicated = false;
+
+	// games that may resign, the others are played out to check resignations
+	bool resign_enabled = true;
+	std::optional<chess::side> resigned;
+	std::optional<chess::side> would_resign;
+
+	// side whose value has stayed below the resign threshold, and for how many plies
+	chess::side losing_side = chess::side_none;
+	int losing_plies = 0;
 
-	torch::Tensor make_image()
+	// search of the current move
+	bool fast_search = false;
+	int simulations = 0;
+	float predicted_plies = -1.0f;	// plies left predicted at the root, negative if unknown
+
+	// workers are stepped by several threads, and each has its own noise
+	std::mt19937 generator{get_generator()()};
+
+	void start_search(int simulations, bool fast_search)
 	{
-		return game_image(game);
+		this->simulations = simulations;
+		this->fast_search = fast_search;
+	}
+
+	void make_image(std::uint8_t* image)
+	{
+		write_game_image(game, image);
 	}
 
 	void expand_root(const torch::Tensor policy)
 	{
 		root = std::make_shared<node>();
 		root->expand(game, policy);
-		add_exploration_noise(*root);
+		add_exploration_noise(*root, generator);
 	}
 
-	torch::Tensor traverse_tree()
+	// Traverse the tree to a leaf that needs evaluation and write its image. Terminal leaves found on the way are backed
+	// up with the result of the game right away. Each traversal is counted, and none is started once the count reaches
+	// the maximum. Returns whether a leaf that needs evaluation was found.
+	bool traverse_tree(std::uint8_t* image, int& traversals, int max_traversals)
 	{
-		std::tie(search_path, scratch_game) = traverse(root, game);
-		return game_image(scratch_game);
+		while(traversals < max_traversals)
+		{
+			traversals++;
+			std::tie(search_path, scratch_game) = traverse(root, game);
+
+			if(!scratch_game.is_terminal())
+			{
+				write_game_image(scratch_game, image);
+				return true;
+			}
+
+			chess::side turn = scratch_game.get_position().get_turn();
+			std::optional<int> v = scratch_game.get_value(chess::opponent(turn));
+			backpropagate(search_path, torch::tensor(static_cast<float>(v.value_or(0))), turn);
+		}
+
+		return false;
 	}
 
 	void expand_leaf(torch::Tensor policy)
@@ -82,6 +137,7 @@ struct worker
 		visits.push_back(root->child_visits());
 		values.push_back(torch::tensor(value_function(game, chess::opponent(game.get_position().get_turn())))); // seems like we have to use opponent here, some mistake in mcts?
 		turns.push_back(game.get_position().get_turn());
+		plies.push_back(game.size());
 	}
 
 	void make_move()
@@ -93,16 +149,98 @@ struct worker
 
 	bool is_terminal(std::size_t max_moves = 512)
 	{
-		return game.is_terminal() || game.size() >= max_moves;
+		return game.is_terminal() || game.size() >= max_moves || adjudicated || resigned;
+	}
+
+	// Value of the game for the side, if it was decided by the rules or by resignation.
+	std::optional<int> outcome(chess::side side)
+	{
+		if(resigned)
+		{
+			return *resigned == side ? -1 : 1;
+		}
+
+		return game.get_value(side);
+	}
+
+	// Resign for the side to move or its opponent once the searched value has been below the threshold for it for the
+	// given plies, and draw a game without progress whose value stays close to even. The value of the best move is
+	// from the side to move.
+	void adjudicate_value(float resign_threshold, int resign_plies, float draw_threshold, int draw_no_progress)
+	{
+		const chess::side turn = game.get_position().get_turn();
+		const float value = root->select_best()->value();
+
+		chess::side losing = chess::side_none;
+
+		if(value < resign_threshold)
+		{
+			losing = turn;
+		}
+		else if(-value < resign_threshold)
+		{
+			losing = chess::opponent(turn);
+		}
+
+		losing_plies = losing != chess::side_none && losing == losing_side ? losing_plies + 1 : 1;
+		losing_side = losing;
+
+		if(losing != chess::side_none && losing_plies >= resign_plies)
+		{
+			if(resign_enabled)
+			{
+				resigned = losing;
+			}
+			else if(!would_resign)
+			{
+				would_resign = losing;
+			}
+		}
+
+		if(game.get_position().get_halfmove_clock() >= draw_no_progress && std::abs(value) < draw_threshold)
+		{
+			adjudicated = true;
+		}
+	}
+
+	// Whether a game that was played out although it would have resigned did not lose.
+	bool false_resign()
+	{
+		return would_resign && outcome(*would_resign).value_or(0) >= 0;
+	}
+
+	// A game that is predicted to go on past the move limit would be cut off as a draw, so end it as one once it has
+	// stopped making progress instead of shuffling until the limit.
+	void adjudicate(float predicted_plies, std::size_t max_moves, std::size_t min_plies, int min_no_progress)
+	{
+		if(game.size() >= min_plies && game.get_position().get_halfmove_clock() >= min_no_progress && game.size() + predicted_plies > max_moves)
+		{
+			adjudicated = true;
+		}
 	}
 
-	void send_replay(std::ostream& out, bool use_terminal_value = true)
+	// Positions are written as one frame for the game, which the trainer replays to render their images, as a frame for
+	// each position, or as the text lines that older trainers read. Returns whether the writer queued them.
+	bool send_replay(replay_writer& writer, bool use_terminal_value = true, const std::string& format = "games")
 	{
 		std::size_t replay_size = images.size();
 
 		if(replay_size == 0)
 		{
-			return;
+			return true;
+		}
+
+		std::string records;
+		replay_game record;
+
+		if(format == "games")
+		{
+			record.start_fen = start_fen;
+
+			for(auto [move, _]: game.get_history())
+			{
+				record.moves.push_back(move);
+			}
 		}
 
 		for(std::size_t i = 0; i < replay_size; i++)
@@ -110,24 +248,192 @@ struct worker
 			torch::Tensor image = images[i];
 			torch::Tensor value = values[i];
 			torch::Tensor policy = visits[i];
+			torch::Tensor moves_left = torch::tensor(-1.0f);
 
 			if(use_terminal_value)
 			{
-				std::optional<int> v = game.get_value(chess::opponent(turns[i])); // todo: maybe this should actually be inverted?
+				std::optional<int> v = outcome(chess::opponent(turns[i])); // todo: maybe this should actually be inverted?
 				value = torch::tensor(v ? static_cast<float>(*v) : 0.0f);
 			}
 
-			std::cout << encode(image) << ' ' << encode(value) << ' ' << encode(policy) << std::endl;
+			// only games that ended by the rules have a known length
+			if(use_terminal_value && game.is_terminal())
+			{
+				moves_left = torch::tensor(static_cast<float>(game.size() - plies[i]));
+			}
+
+			if(format == "games")
+			{
+				record.plies.push_back(plies[i]);
+				record.positions.push_back({torch::Tensor(), value, policy, moves_left});
+			}
+			else if(format == "text")
+			{
+				records += encode_replay({image, value, policy, moves_left}) + '\n';
+			}
+			else
+			{
+				records += encode_replay_frame({image, value, policy, moves_left});
+			}
+		}
+
+		if(format == "games")
+		{
+			records = encode_replay_frame(record);
 		}
 
 		images.clear();
 		visits.clear();
 		values.clear();
 		turns.clear();
+		plies.clear();
+
+		return writer.write(records);
 	}
 };
 
 
+// Search the moves of the games of the worker, suspended while its positions are evaluated in batches with those of
+// other workers. The searched worker is handed to the function, which plays the move and starts the next search or game.
+static task search_games(worker& searcher, batch_scheduler& scheduler, const std::function<void(worker&)>& play)
+{
+	std::vector<std::uint8_t> image(image_planes()*64);
+
+	while(true)
+	{
+		searcher.make_image(image.data());
+		position_evaluation root = co_await scheduler.evaluate(image.data(), true);
+
+		searcher.expand_root(root.policy);
+		searcher.predicted_plies = root.plies;
+
+		// every traversal counts as a simulation, also those that only reach terminal positions and need no evaluation
+		int simulation = 0;
+
+		while(searcher.traverse_tree(image.data(), simulation, searcher.simulations))
+		{
+			position_evaluation leaf = co_await scheduler.evaluate(image.data());
+
+			searcher.expand_leaf(leaf.policy);
+			searcher.backpropagate_path(leaf.value);
+		}
+
+		play(searcher);
+	}
+}
+
+
+// Settings found by autotuning on this host. Hosts that share a directory keep their own.
+static std::filesystem::path tuning_path()
+{
+	char host[256] = {};
+	gethostname(host, sizeof(host) - 1);
+
+	return "selfplay." + std::string(host) + ".cfg";
+}
+
+
+// Sweep batch sizes and intra-op threads with the model, measuring positions evaluated per second by tree search, and
+// write the fastest as options of selfplay. Threads are swept up to those libtorch was configured with.
+static void autotune(evaluator& model, const std::filesystem::path& path, int simulations, thread_pool& pool)
+{
+	const std::vector<int> batch_sizes = {16, 32, 64, 128, 256};
+	const int max_threads = at::get_num_threads();
+
+	std::vector<int> thread_counts;
+
+	for(int threads = 1; threads < max_threads; threads *= 2)
+	{
+		thread_counts.push_back(threads);
+	}
+
+	thread_counts.push_back(max_threads);
+
+	int best_batch_size = 0;
+	int best_threads = 0;
+	double best_throughput = 0.0;
+	double best_latency = 0.0;
+
+	for(int threads: thread_counts)
+	{
+		at::set_num_threads(threads);
+
+		for(int batch_size: batch_sizes)
+		{
+			double evaluation_time = 0.0;
+			bool measuring = false;
+
+			const evaluator timed_model = [&](torch::Tensor images)
+			{
+				auto evaluation_start = std::chrono::steady_clock::now();
+				std::pair<torch::Tensor, torch::Tensor> evaluation = model(images);
+
+				if(measuring)
+				{
+					evaluation_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - evaluation_start).count();
+				}
+
+				return evaluation;
+			};
+
+			const std::function<void(worker&)> play = [](worker&) {};
+			std::vector<worker> workers(batch_size);
+			batch_scheduler scheduler(batch_size, pool);
+
+			// searches do not end while measuring
+			for(worker& searcher: workers)
+			{
+				searcher.start_search(simulations + 3, false);
+				scheduler.spawn(search_games(searcher, scheduler, play));
+			}
+
+			long positions = 0;
+			std::chrono::steady_clock::time_point start;
+
+			// the first batch evaluates the roots, and TorchScript specializes for the batch size in the first runs
+			for(int simulation = -3; simulation < simulations; simulation++)
+			{
+				if(simulation == 0)
+				{
+					start = std::chrono::steady_clock::now();
+					measuring = true;
+				}
+
+				// evaluation runs within the step, since the scheduler is not pipelined
+				int evaluated = scheduler.step(timed_model, nullptr);
+
+				if(simulation >= 0)
+				{
+					positions += evaluated;
+				}
+			}
+
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			double throughput = positions/elapsed.count();
+			double latency = evaluation_time/simulations;
+
+			std::cerr << "autotune: batch " << batch_size << ", " << threads << " threads: " << throughput << " positions/s, " << latency*1000.0 << " ms per evaluation" << std::endl;
+
+			if(throughput > best_throughput)
+			{
+				best_batch_size = batch_size;
+				best_threads = threads;
+				best_throughput = throughput;
+				best_latency = latency;
+			}
+		}
+	}
+
+	std::ofstream file(path);
+	file << "# autotuned: " << best_throughput << " positions/s, " << best_latency*1000.0 << " ms per evaluation" << std::endl;
+	file << "--batch-size=" << best_batch_size << std::endl;
+	file << "--intra-threads=" << best_threads << std::endl;
+
+	std::cerr << "autotune: batch " << best_batch_size << ", " << best_threads << " threads written to " << path << std::endl;
+}
+
+
 int main(int argc, char **argv)
 {
 	// configuration
@@ -137,7 +443,13 @@ int main(int argc, char **argv)
 	const float fast_search_prob = 0.0f;
 
 	const int max_moves = 512;
-	const int batch_size = 64;
+
+	const std::size_t adjudication_plies = 160;	// adjudicate games by predicted moves left after this many plies
+	const int adjudication_no_progress = 40;	// and this many plies without captures or pawn moves
+
+	const int resign_plies = 6;	// resign after the value of a side has been below the threshold for this many plies
+	const float draw_threshold = 0.05f;	// draw games with values closer to even than this
+	const int draw_no_progress = 60;	// after this many plies without captures or pawn moves
 
 	const bool send_on_termination = true;
 
@@ -145,25 +457,85 @@ int main(int argc, char **argv)
 
 	// statistics
 
-	long searches = 0;
 	long sent = 0;
 	int white_wins = 0;
 	int black_wins = 0;
 	int draws = 0;
+	int adjudications = 0;
+	int resignations = 0;
+	int checked_resignations = 0;	// games played out that would have resigned
+	int false_resignations = 0;	// and did not lose
+
+	arguments args(argc, argv);
 
-	if(argc != 2)
+	if(args.positional.size() != 1)
 	{
 		std::cerr << "missing model path" << std::endl;
 		return 1;
 	}
 	else
 	{
-		std::cerr << "using model path " << argv[1] << std::endl;
+		std::cerr << "using model path " << args.positional[0] << std::endl;
 	}
 
+	// settings of this host, unless they are being tuned or are given on the command line
+	const bool tune = args.has("autotune");
+	const std::filesystem::path config_path = args.get<std::string>("config", tuning_path().string());
+
+	if(!tune && std::filesystem::exists(config_path))
+	{
+		std::ifstream config(config_path);
+		args.add_defaults(config);
+		std::cerr << "using settings of " << config_path << std::endl;
+	}
+
+	const int batch_size = args.get<int>("batch-size", 64);
+	const int pipeline_groups = args.get<int>("pipeline-groups", 1);
+	const int games = args.get<int>("games", batch_size*pipeline_groups);	// games searched at once, more overlap tree work and inference
+	const std::string replay_format = args.get<std::string>("replays", "games");
+	const float resign_threshold = args.get<float>("resign-threshold", -0.9f);	// -1 never resigns
+	const float resign_playouts = args.get<float>("resign-playouts", 0.1f);	// fraction of games played out without resigning
+
+	thread_options threads(args);
+	configure_threads(threads);
+
+	// tree work and evaluation take turns when all games fit in a batch, so the tree can use as many threads as libtorch,
+	// but with more games they run at once and the first --tree-cores of the cores run the tree and the rest evaluation
+	const bool pipelined = games > batch_size;
+	thread_options evaluation_threads = threads;
+	int tree_threads = at::get_num_threads();
+
+	if(pipelined && !tune && args.has("tree-cores"))
+	{
+		thread_options tree;
+
+		try
+		{
+			std::tie(tree, evaluation_threads) = split_cores(threads, args.get<int>("tree-cores", 0));
+		}
+		catch(const std::invalid_argument& e)
+		{
+			std::cerr << "invalid --tree-cores: " << e.what() << std::endl;
+			return 1;
+		}
+
+		// the threads of the pool inherit the cores of the main thread, which steps the tree with them
+		configure_thread(tree);
+		tree_threads = tree.cores.size();
+
+		std::cerr << "running the tree on " << tree.cores.size() << " cores and evaluation on " << evaluation_threads.cores.size() << " cores with " << evaluation_threads.intra_op << " intra-op threads" << std::endl;
+	}
+
+	thread_pool pool(args.get<int>("tree-threads", tree_threads));
+	std::cerr << "stepping workers with " << pool.size() << " threads" << std::endl;
+
+	// replays are written by their own thread, and dropped rather than stalling search while the trainer falls behind
+	replay_writer writer(std::cout, args.get<std::size_t>("replay-buffer", 64) << 20);
+
 	chess::init();
-	torch::NoGradGuard no_grad;
-	std::filesystem::path model_path(argv[1]);
+	c10::InferenceMode inference_mode;
+	std::filesystem::path model_path(args.positional[0]);
+	inference_options inference(args);
 
 	// wait for initial model
 	while(!std::filesystem::exists(model_path))
@@ -178,132 +550,193 @@ int main(int argc, char **argv)
 	}
 
 	// load initial model
-	sigmanet model = make_network();
 	torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
-
-	torch::load(model, model_path);
-	model->to(device);
-	model->eval();
-	model->zero_grad();
+	evaluator model = load_evaluator(model_path, device, {batch_size}, inference);
 
 	std::cerr << "loaded model" << std::endl;
 
-	auto model_changed = std::filesystem::last_write_time(model_path);
-	std::bernoulli_distribution search_type_dist(fast_search_prob);
-	bool fill_window = false;
+	if(tune)
+	{
+		autotune(model, config_path, args.get<int>("autotune-simulations", 16), pool);
+		return 0;
+	}
 
-	std::vector<worker> workers(batch_size);
-	std::vector<torch::Tensor> batch_images(batch_size);
+	moves_left_evaluator moves_left = load_moves_left(model_path, device);
 
-	while(true)
+	// updated models are loaded and run once in the background, and swapped in between batches
+	model_reloader reloader(model_path, [&]()
 	{
-		// load latest model
-		auto model_write = std::filesystem::last_write_time(model_path);
-		if(model_write > model_changed)
-		{
-			try
-			{
-				torch::load(model, model_path);
-				model->to(device);
-				model_changed = model_write;
-				std::cerr << "updated model loaded" << std::endl;
-			}
-			catch(const std::exception& e)
-			{
-				std::cerr << "loading updated model failed" << std::endl;
-			}
+		c10::InferenceMode inference_mode;
+		loaded_model loaded{load_evaluator(model_path, device, {batch_size}, inference), load_moves_left(model_path, device)};
 
-			// training has started and window is full
-			fill_window = false;
-		}
+		torch::Tensor images = torch::zeros({batch_size, image_planes(), 8, 8}, torch::kUInt8);
+		loaded.model(images);
 
-		// initial evaluation
-		for(int i = 0; i < batch_size; i++)
+		if(loaded.moves_left)
 		{
-			batch_images[i] = workers[i].make_image();
+			loaded.moves_left(images);
 		}
 
-		auto [_, batch_policies] = model->forward(torch::stack(batch_images).to(device));
+		return loaded;
+	}, evaluation_threads);
 
-		// expand roots		
-		for(int i = 0; i < batch_size; i++)
-		{
-			workers[i].expand_root(batch_policies.index({i}));
-		}
+	std::bernoulli_distribution search_type_dist(fast_search_prob);
+	bool fill_window = false;
 
-		// tree search
-		int simulations = full_search_iterations;
+	std::bernoulli_distribution playout_dist(resign_playouts);
+
+	auto start_search = [&](worker& searcher)
+	{
 		bool fast_search = search_type_dist(get_generator());
+		searcher.start_search(fast_search || fill_window ? fast_search_iterations : full_search_iterations, fast_search);
+	};
+
+	auto new_worker = [&]()
+	{
+		worker new_worker;
+		new_worker.resign_enabled = !playout_dist(get_generator());
+		start_search(new_worker);
+
+		return new_worker;
+	};
 
-		if(fast_search || fill_window)
+	// moves are played by the threads of the pool, one at a time since they share the statistics and the writer
+	std::mutex play_mutex;
+	long moves = 0;
+
+	const std::function<void(worker&)> play = [&](worker& searcher)
+	{
+		std::lock_guard<std::mutex> lock(play_mutex);
+		moves++;
+
+		// hope that filling the initial window with replays of poor quality is ok...
+		if(!searcher.fast_search || fill_window)
 		{
-			simulations = fast_search_iterations;
+			searcher.save_image(value_function);
 		}
 
-		for(int simulation = 0; simulation < simulations; simulation++)
+		// resign or draw before playing the searched move
+		searcher.adjudicate_value(resign_threshold, resign_plies, draw_threshold, draw_no_progress);
+
+		if(!searcher.is_terminal(max_moves))
 		{
-			for(int i = 0; i < batch_size; i++)
+			searcher.make_move();
+
+			if(searcher.predicted_plies >= 0.0f)
 			{
-				batch_images[i] = workers[i].traverse_tree();
+				// one ply was just played
+				searcher.adjudicate(searcher.predicted_plies - 1.0f, max_moves, adjudication_plies, adjudication_no_progress);
 			}
+		}
+
+		bool send_replay = !send_on_termination || searcher.is_terminal(max_moves);
 
-			auto [batch_values, batch_policies] = model->forward(torch::stack(batch_images).to(device));
+		if(send_replay)
+		{
+			std::size_t replay_size = searcher.images.size();
 
-			for(int i = 0; i < batch_size; i++)
+			if(searcher.send_replay(writer, send_on_termination, replay_format))
 			{
-				workers[i].expand_leaf(batch_policies.index({i}));
-				workers[i].backpropagate_path(batch_values.index({i}));
+				sent += replay_size;
 			}
 		}
 
-		for(int i = 0; i < batch_size; i++)
+		if(searcher.is_terminal(max_moves))
 		{
-			// hope that filling the initial window with replays of poor quality is ok...
-			if(!fast_search || fill_window)
+			std::cerr << "terminal: " << searcher.game.size() << " plies, ";
+			
+			for(auto [move, _]: searcher.game.get_history())
 			{
-				workers[i].save_image(value_function);
+				std::cerr << move.to_lan() << " ";
 			}
 
-			workers[i].make_move();
+			std::optional<int> value = searcher.outcome(chess::side_white);
+			std::string outcome = "-";
+
+			if(value)
+			{
+				white_wins += *value > 0;
+				black_wins += *value < 0;
+				draws += *value == 0;
 
-			bool send_replay = !send_on_termination || workers[i].is_terminal(max_moves);
+				outcome = std::to_string(*value);
+			}
 
-			if(send_replay)
+			if(searcher.adjudicated)
 			{
-				sent += workers[i].images.size();
-				workers[i].send_replay(std::cout, send_on_termination);
+				adjudications++;
+				outcome = "adjudicated";
 			}
 
-			if(workers[i].is_terminal(max_moves))
+			if(searcher.resigned)
 			{
-				std::cerr << "terminal: " << workers[i].game.size() << " plies, ";
-				
-				for(auto [move, _]: workers[i].game.get_history())
-				{
-					std::cerr << move.to_lan() << " ";
-				}
+				resignations++;
+				outcome += " resigned";
+			}
 
-				std::optional<int> value = workers[i].game.get_value();
-				std::string outcome = "-";
+			if(searcher.would_resign)
+			{
+				checked_resignations++;
+				false_resignations += searcher.false_resign();
+			}
 
-				if(value)
-				{
-					white_wins += *value > 0;
-					black_wins += *value < 0;
-					draws += *value == 0;
+			std::cerr << outcome << std::endl;
 
-					outcome = std::to_string(*value);
-				}
+			searcher = new_worker();
+		}
+		else
+		{
+			start_search(searcher);
+		}
+	};
 
-				std::cerr << outcome << std::endl;
+	// each worker is constructed, so that each has its own noise
+	std::vector<worker> workers;
 
-				workers[i] = worker{};
-			}
+	for(int i = 0; i < games; i++)
+	{
+		workers.push_back(new_worker());
+	}
+
+	// batches are evaluated in the background while the games of the previous one run, if there are more games than fit
+	// in a batch
+	batch_scheduler scheduler(batch_size, pool, pipelined, evaluation_threads);
+
+	for(worker& searcher: workers)
+	{
+		scheduler.spawn(search_games(searcher, scheduler, play));
+	}
+
+	std::cerr << "searching " << games << " games in batches of " << batch_size << std::endl;
+
+	long evaluated = 0;
+	long logged_moves = 0;
+
+	while(true)
+	{
+		// swap in latest model, the batch in evaluation keeps the one it started with
+		if(std::optional<loaded_model> loaded = reloader.take())
+		{
+			model = std::move(loaded->model);
+			moves_left = std::move(loaded->moves_left);
+			std::cerr << "updated model swapped in" << std::endl;
+
+			// training has started and window is full
+			fill_window = false;
 		}
 
-		searches++;
+		// the games are suspended between steps
+		evaluated += scheduler.step(model, moves_left);
+
+		if(moves - logged_moves >= games)
+		{
+			logged_moves = moves;
+
+			replay_writer::statistics writes = writer.get_statistics();
 
-		std::cerr << "batch: " << searches << " searches, " << searches*batch_size << " moves, " << sent << " sent, " << white_wins << " white wins, " << black_wins << " black wins, " << draws << " draws" << std::endl; 
+			std::cerr << "batch: " << evaluated << " evaluated, " << moves << " moves, " << sent << " sent, " << white_wins << " white wins, " << black_wins << " black wins, " << draws << " draws, " << adjudications << " adjudicated, " << resignations << " resigned, " << false_resignations << "/" << checked_resignations << " false resignations" << std::endl; 
+			std::cerr << "replays: " << writes.records << " queued, " << writes.dropped << " dropped, " << writer.pending() << " bytes pending, " << writes.write_seconds << " s writing" << std::endl;
+		}
 	}
 
 	return 0;
@@ -3,36 +3,173 @@
 #include <cmath>
 #include <chess/chess.hpp>
 #include <iostream>
+#include <ATen/autocast_mode.h>
+#include <stdexcept>
+#include <string>
 
 #include "sigmanet.hpp"
 #include "rules.hpp"
 
 
-residual_block::residual_block(int filters) {
+policy_head_type policy_head_of(const std::string& name) {
 
-    conv1 = torch::nn::Conv2d(torch::nn::Conv2dOptions(filters, filters, 3).padding(1));
-    batchnorm1 = torch::nn::BatchNorm2d(filters);
+    if (name == "linear") {
+        return policy_head_type::linear;
+    }
+    else if (name == "conv") {
+        return policy_head_type::convolutional;
+    }
+
+    throw std::invalid_argument("unknown policy head " + name);
+}
+
+
+static void fold(torch::nn::Conv2dImpl& conv, torch::nn::BatchNorm2dImpl& batchnorm) {
 
-    conv2 = torch::nn::Conv2d(torch::nn::Conv2dOptions(filters, filters, 3).padding(1));
-    batchnorm2 = torch::nn::BatchNorm2d(filters);
+    torch::NoGradGuard no_grad;
 
-    register_module("conv1", conv1);
-    register_module("batchnorm1", batchnorm1);
-    register_module("conv2", conv2);
-    register_module("batchnorm2", batchnorm2);
+    torch::Tensor scale = batchnorm.weight / torch::sqrt(batchnorm.running_var + batchnorm.options.eps());
+
+    conv.weight.mul_(scale.reshape({-1, 1, 1, 1}));
+    conv.bias.sub_(batchnorm.running_mean).mul_(scale).add_(batchnorm.bias);
 }
 
-torch::Tensor residual_block::forward(torch::Tensor x) {
+static torch::nn::Sequential fold_sequential(torch::nn::Sequential sequential, bool fold_weights) {
 
-    torch::Tensor y = x;
+    torch::nn::Sequential folded;
+    std::shared_ptr<torch::nn::Conv2dImpl> conv;
+    int i = 0;
 
-    x = conv1->forward(x);
-    x = batchnorm1->forward(x);
+    // keep indices as names, so that remaining parameters are named as before
+    for (const torch::nn::AnyModule& module : *sequential) {
+        auto batchnorm = std::dynamic_pointer_cast<torch::nn::BatchNorm2dImpl>(module.ptr());
 
-    x = torch::relu(x);
+        if (batchnorm && conv) {
+            if (fold_weights) {
+                fold(*conv, *batchnorm);
+            }
+        }
+        else {
+            conv = std::dynamic_pointer_cast<torch::nn::Conv2dImpl>(module.ptr());
+            folded->push_back(std::to_string(i), module);
+        }
+
+        i++;
+    }
+
+    return folded;
+}
+
+
+// set while building networks whose parameters are replaced after construction
+static thread_local bool parameters_uninitialised = false;
+
+// Uninitialised layers are built with one channel per group and then given empty parameters of their full size, since
+// drawing random weights for a large network costs as much as loading it.
+static torch::nn::Conv2d make_conv(torch::nn::Conv2dOptions options) {
+
+    if (!parameters_uninitialised) {
+        return torch::nn::Conv2d(options);
+    }
+
+    const int64_t in_channels = options.in_channels();
+    const int64_t out_channels = options.out_channels();
+
+    torch::nn::Conv2d conv(options.in_channels(options.groups()).out_channels(options.groups()));
+    conv->options.in_channels(in_channels).out_channels(out_channels);
+
+    conv->weight.set_data(torch::empty({out_channels, in_channels/options.groups(), options.kernel_size()->at(0), options.kernel_size()->at(1)}));
+
+    if (options.bias()) {
+        conv->bias.set_data(torch::empty({out_channels}));
+    }
+
+    return conv;
+}
+
+static torch::nn::Linear make_linear(int64_t in_features, int64_t out_features) {
+
+    if (!parameters_uninitialised) {
+        return torch::nn::Linear(in_features, out_features);
+    }
+
+    torch::nn::Linear linear(1, 1);
+    linear->options = torch::nn::LinearOptions(in_features, out_features);
+
+    linear->weight.set_data(torch::empty({out_features, in_features}));
+    linear->bias.set_data(torch::empty({out_features}));
+
+    return linear;
+}
+
+
+block_type block_type_of(const std::string& name) {
+
+    if (name == "basic") {
+        return block_type::basic;
+    }
+    else if (name == "bottleneck") {
+        return block_type::bottleneck;
+    }
+    else if (name == "depthwise") {
+        return block_type::depthwise;
+    }
+
+    throw std::invalid_argument("unknown block type " + name);
+}
+
+int default_width(block_type type, int filters) {
+
+    return type == block_type::bottleneck ? filters/2 : filters;
+}
+
+
+void residual_block::add_layer(int in_channels, int out_channels, int kernel_size, int groups, bool batchnorm, bool relu) {
+
+    const std::string number = std::to_string(layers.size() + 1);
+    layer l;
+
+    l.conv = register_module("conv" + number, make_conv(torch::nn::Conv2dOptions(in_channels, out_channels, kernel_size).padding(kernel_size/2).groups(groups)));
+
+    if (batchnorm) {
+        l.batchnorm = register_module("batchnorm" + number, torch::nn::BatchNorm2d(out_channels));
+    }
+
+    l.relu = relu;
+    layers.push_back(l);
+}
+
+residual_block::residual_block(int filters, int width, block_type type) {
+
+    switch (type) {
+    case block_type::basic:
+        add_layer(filters, width, 3, 1, true, true);
+        add_layer(width, filters, 3, 1, true, false);
+        break;
+    case block_type::bottleneck:
+        add_layer(filters, width, 1, 1, true, true);
+        add_layer(width, width, 3, 1, true, true);
+        add_layer(width, filters, 1, 1, true, false);
+        break;
+    case block_type::depthwise:
+        // depthwise convolutions are linear, normalization and activation follow the pointwise ones
+        add_layer(filters, filters, 3, filters, false, false);
+        add_layer(filters, width, 1, 1, true, true);
+        add_layer(width, width, 3, width, false, false);
+        add_layer(width, filters, 1, 1, true, false);
+        break;
+    }
+}
+
+torch::Tensor residual_block::forward(torch::Tensor x) {
 
-    x = conv2->forward(x);
-    x = batchnorm2->forward(x);
+    torch::Tensor y = x;
+
+    for (layer& l : layers) {
+        x = l.conv->forward(x);
+        if (l.batchnorm && !folded) x = l.batchnorm->forward(x);
+        if (l.relu) x = torch::relu(x);
+    }
 
     x = y + x;
     x = torch::relu(x);
@@ -40,10 +177,32 @@ torch::Tensor residual_block::forward(torch::Tensor x) {
     return x;
 }
 
-sigmanet_impl::sigmanet_impl(int channels, int filters, int blocks) : channels{channels}, filters{filters}, blocks{blocks} {
+void residual_block::fold_batchnorm(bool fold_weights) {
+
+    if (folded) {
+        return;
+    }
+
+    for (layer& l : layers) {
+        if (l.batchnorm && fold_weights) {
+            fold(*l.conv, *l.batchnorm);
+        }
+    }
+
+    folded = true;
+}
+
+sigmanet_impl::sigmanet_impl(int channels, int filters, int blocks, policy_head_type policy_type, block_type residual_type, std::vector<int> widths, bool moves_left) : channels{channels}, filters{filters}, blocks{blocks}, policy_type{policy_type}, residual_type{residual_type}, widths{widths}, moves_left_enabled{moves_left} {
+
+    if (this->widths.empty()) {
+        this->widths.assign(blocks, default_width(residual_type, filters));
+    }
+    else if (this->widths.size() != static_cast<std::size_t>(blocks)) {
+        throw std::invalid_argument("expected a width for each of the " + std::to_string(blocks) + " blocks");
+    }
 
     input_conv = torch::nn::Sequential(
-        torch::nn::Conv2d(torch::nn::Conv2dOptions(channels, filters, 3).stride(1).padding(1)),
+        make_conv(torch::nn::Conv2dOptions(channels, filters, 3).stride(1).padding(1)),
         torch::nn::BatchNorm2d(filters),
         torch::nn::ReLU()
     );
@@ -51,46 +210,254 @@ sigmanet_impl::sigmanet_impl(int channels, int filters, int blocks) : channels{c
     residual = torch::nn::Sequential();
 
     for (int i = 0; i < blocks; i++) {
-        residual->push_back(residual_block(filters));
+        residual->push_back(residual_block(filters, this->widths[i], residual_type));
     }
 
     value_head = torch::nn::Sequential(
-        torch::nn::Conv2d(torch::nn::Conv2dOptions(filters, 1, 1)),
+        make_conv(torch::nn::Conv2dOptions(filters, 1, 1)),
         torch::nn::BatchNorm2d(1),
         torch::nn::ReLU(),
         torch::nn::Flatten(torch::nn::FlattenOptions().start_dim(-2).end_dim(-1)),
-        torch::nn::Linear(8 * 8, 256),
+        make_linear(8 * 8, 256),
         torch::nn::ReLU(),
         torch::nn::Flatten(torch::nn::FlattenOptions().start_dim(-2).end_dim(-1)),
-        torch::nn::Linear(256, 1),
+        make_linear(256, 1),
         torch::nn::Tanh()
     );
 
-    policy_head = torch::nn::Sequential(
-        torch::nn::Conv2d(torch::nn::Conv2dOptions(filters, 2, 1)),
-        torch::nn::BatchNorm2d(2),
-        torch::nn::ReLU(),
-        torch::nn::Flatten(torch::nn::FlattenOptions().start_dim(-3).end_dim(-1)),
-        torch::nn::Linear(2 * 8 * 8, 8 * 8 * 73)
-    );
+    if (policy_type == policy_head_type::convolutional) {
+        // planes are moved last in forward, to order actions by square
+        policy_head = torch::nn::Sequential(
+            make_conv(torch::nn::Conv2dOptions(filters, actions_per_square, 1))
+        );
+    }
+    else {
+        policy_head = torch::nn::Sequential(
+            make_conv(torch::nn::Conv2dOptions(filters, 2, 1)),
+            torch::nn::BatchNorm2d(2),
+            torch::nn::ReLU(),
+            torch::nn::Flatten(torch::nn::FlattenOptions().start_dim(-3).end_dim(-1)),
+            make_linear(2 * 8 * 8, 8 * 8 * 73)
+        );
+    }
 
     register_module("input_conv", input_conv);
     register_module("residual", residual);
     register_module("value_head", value_head);
     register_module("policy_head", policy_head);
+
+    if (moves_left) {
+        // plies are not negative
+        moves_left_head = torch::nn::Sequential(
+            make_conv(torch::nn::Conv2dOptions(filters, 1, 1)),
+            torch::nn::BatchNorm2d(1),
+            torch::nn::ReLU(),
+            torch::nn::Flatten(torch::nn::FlattenOptions().start_dim(-3).end_dim(-1)),
+            make_linear(8 * 8, 128),
+            torch::nn::ReLU(),
+            make_linear(128, 1),
+            torch::nn::ReLU()
+        );
+
+        register_module("moves_left_head", moves_left_head);
+    }
+
+    count_mask = count_plane_mask(channels);
 }
 
 
-std::pair<torch::Tensor, torch::Tensor> sigmanet_impl::forward(torch::Tensor x) {
+torch::Tensor sigmanet_impl::decode(torch::Tensor x) {
+    // uint8 images are converted for the whole batch here, to keep them small until now
+    x = x.to(torch::kFloat);
+
+    if (count_mask.device() != x.device()) {
+        count_mask = count_mask.to(x.device());
+    }
+
+    x = x + count_mask*(x.sum({-2, -1}, true) - x);
+
+    if (channels_last) {
+        x = x.contiguous(torch::MemoryFormat::ChannelsLast);
+    }
+
+    return x;
+}
+
+
+torch::Tensor sigmanet_impl::features(torch::Tensor x) {
+    x = decode(x);
     x = input_conv->forward(x);
     x = residual->forward(x);
 
+    return x;
+}
+
+
+std::pair<torch::Tensor, torch::Tensor> sigmanet_impl::forward(torch::Tensor x) {
+    x = features(x);
+
     auto value = value_head->forward(x);
     auto policy = policy_head->forward(x);//torch::softmax(policy_head->forward(x), -1);
 
+    if (policy_type == policy_head_type::convolutional) {
+        policy = policy.permute({0, 2, 3, 1}).flatten(1);
+    }
+
     return std::make_pair(value, policy);
 }
 
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> sigmanet_impl::forward_moves_left(torch::Tensor x) {
+
+    if (!moves_left_enabled) {
+        throw std::logic_error("network has no moves-left head");
+    }
+
+    x = features(x);
+
+    auto value = value_head->forward(x);
+    auto policy = policy_head->forward(x);
+    auto plies = moves_left_head->forward(x).flatten();
+
+    if (policy_type == policy_head_type::convolutional) {
+        policy = policy.permute({0, 2, 3, 1}).flatten(1);
+    }
+
+    return std::make_tuple(value, policy, plies);
+}
+
+torch::Tensor sigmanet_impl::moves_left(torch::Tensor x) {
+
+    if (!moves_left_enabled) {
+        throw std::logic_error("network has no moves-left head");
+    }
+
+    return moves_left_head->forward(features(x)).flatten();
+}
+
+void sigmanet_impl::fold_batchnorm(bool fold_weights) {
+
+    // running statistics are used when folding, as in eval mode
+    eval();
+
+    input_conv = replace_module("input_conv", fold_sequential(input_conv, fold_weights));
+
+    for (torch::nn::AnyModule& module : *residual) {
+        module.get<residual_block>().fold_batchnorm(fold_weights);
+    }
+
+    value_head = replace_module("value_head", fold_sequential(value_head, fold_weights));
+    policy_head = replace_module("policy_head", fold_sequential(policy_head, fold_weights));
+
+    if (moves_left_head) {
+        moves_left_head = replace_module("moves_left_head", fold_sequential(moves_left_head, fold_weights));
+    }
+}
+
+void sigmanet_impl::to_channels_last() {
+
+    torch::NoGradGuard no_grad;
+
+    for (torch::Tensor& parameter : parameters()) {
+        if (parameter.dim() == 4) {
+            parameter.set_data(parameter.contiguous(torch::MemoryFormat::ChannelsLast));
+        }
+    }
+
+    channels_last = true;
+}
+
+
+void save_network(sigmanet model, const std::filesystem::path& path) {
+
+    torch::serialize::OutputArchive archive;
+    model->save(archive);
+
+    // widths of the blocks follow the fixed fields
+    std::vector<int64_t> architecture = {model->get_channels(), model->get_filters(), model->get_blocks(), static_cast<int>(model->get_policy_type())};
+    architecture.insert(architecture.end(), model->get_widths().begin(), model->get_widths().end());
+
+    archive.write("architecture", torch::tensor(architecture, torch::kLong), true);
+    archive.write("block_type", torch::tensor(static_cast<int64_t>(model->get_block_type())), true);
+    archive.write("moves_left", torch::tensor(static_cast<int64_t>(model->has_moves_left())), true);
+
+    // readers that watch the path never load a partially written model
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+
+    archive.save_to(temporary_path.string());
+    std::filesystem::rename(temporary_path, path);
+}
+
+sigmanet load_network(const std::filesystem::path& path) {
+
+    torch::serialize::InputArchive archive;
+    archive.load_from(path.string());
+
+    torch::Tensor architecture;
+    torch::Tensor residual_type;
+    torch::Tensor moves_left;
+    sigmanet model = nullptr;
+
+    if (archive.try_read("architecture", architecture, true)) {
+        auto a = architecture.accessor<int64_t, 1>();
+        std::vector<int> widths(a.data() + 4, a.data() + a.size(0));
+
+        // models of basic blocks may be saved without the type
+        block_type type = archive.try_read("block_type", residual_type, true) ? static_cast<block_type>(residual_type.item<int64_t>()) : block_type::basic;
+
+        // as are models without a moves-left head
+        bool has_moves_left = archive.try_read("moves_left", moves_left, true) && moves_left.item<int64_t>() != 0;
+
+        model = sigmanet(a[0], a[1], a[2], static_cast<policy_head_type>(a[3]), type, widths, has_moves_left);
+    }
+    else {
+        model = make_network();
+    }
+
+    model->load(archive);
+
+    return model;
+}
+
+
+bf16_autocast::bf16_autocast(bool enabled) : enabled{enabled} {
+
+    if (!enabled) {
+        return;
+    }
+
+    previous_enabled = at::autocast::is_cpu_enabled();
+    previous_dtype = at::autocast::get_autocast_cpu_dtype();
+
+    at::autocast::set_cpu_enabled(true);
+    at::autocast::set_autocast_cpu_dtype(at::kBFloat16);
+}
+
+bf16_autocast::~bf16_autocast() {
+
+    if (!enabled) {
+        return;
+    }
+
+    at::autocast::set_cpu_enabled(previous_enabled);
+    at::autocast::set_autocast_cpu_dtype(previous_dtype);
+
+    // casts of the weights are cached while autocast is enabled
+    if (!previous_enabled) {
+        at::autocast::clear_cache();
+    }
+}
+
+
+uninitialised_parameters::uninitialised_parameters() : previous{parameters_uninitialised} {
+
+    parameters_uninitialised = true;
+}
+
+uninitialised_parameters::~uninitialised_parameters() {
+
+    parameters_uninitialised = previous;
+}
 
 
 // z is model output value, v is mcts value, p is model output policy, pi is mcts policy
@@ -103,3 +470,13 @@ torch::Tensor sigma_loss(torch::Tensor z, torch::Tensor v, torch::Tensor p, torc
 
     return loss;
 }
+
+torch::Tensor moves_left_loss(torch::Tensor m, torch::Tensor plies) {
+    // in units of 20 plies, so that the loss is of the scale of the value loss
+    const float scale = 20.0f;
+
+    torch::Tensor known = plies >= 0;
+    torch::Tensor loss = torch::smooth_l1_loss(m.flatten()/scale, plies.clamp_min(0)/scale, torch::Reduction::None);
+
+    return (loss*known).sum();
+}
\ No newline at end of file
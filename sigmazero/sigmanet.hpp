@@ -4,22 +4,71 @@
 
 #include <torch/torch.h>
 #include <chess/chess.hpp>
+#include <filesystem>
+#include <string>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+
+// The linear head maps two planes of features to all actions. The convolutional head maps the features of each square
+// to the actions from it, as planes in the order of move_action.
+enum class policy_head_type {
+    linear,
+    convolutional
+};
+
+// Policy head type of a name given on the command line, linear or conv.
+policy_head_type policy_head_of(const std::string& name);
+
+
+// The basic block has two 3x3 convolutions. The bottleneck block reduces channels with a 1x1 convolution, convolves
+// them with a 3x3 convolution and expands them back with a 1x1 convolution. The depthwise block has two depthwise
+// separable convolutions, each a 3x3 convolution of every channel by itself followed by a 1x1 convolution.
+enum class block_type {
+    basic,
+    bottleneck,
+    depthwise
+};
+
+// Block type of a name given on the command line, basic, bottleneck or depthwise.
+block_type block_type_of(const std::string& name);
+
+// Width of blocks of the type when not given, as channels between the convolutions.
+int default_width(block_type type, int filters);
 
 
 class residual_block : public torch::nn::Module {
 
-    torch::nn::Conv2d conv1 = nullptr;
-    torch::nn::BatchNorm2d batchnorm1 = nullptr;
-    torch::nn::Conv2d conv2 = nullptr;
-    torch::nn::BatchNorm2d batchnorm2 = nullptr;
+public:
+
+    // Convolutions of a block are named conv1, conv2 and so on, and batch normalizations after them by the same number.
+    struct layer {
+        torch::nn::Conv2d conv = nullptr;
+        torch::nn::BatchNorm2d batchnorm = nullptr;
+        bool relu = false;
+    };
+
+private:
+
+    std::vector<layer> layers;
+
+    bool folded = false;
+
+    void add_layer(int in_channels, int out_channels, int kernel_size, int groups, bool batchnorm, bool relu);
 
 public:
 
-    residual_block(int filters);
+    // The width is the number of channels between the convolutions, which pruning narrows.
+    residual_block(int filters, int width, block_type type = block_type::basic);
 
     torch::Tensor forward(torch::Tensor x);
 
+    // Without folding the weights only the flag is set, for weights that were folded before they were saved.
+    void fold_batchnorm(bool fold_weights = true);
+
+    const std::vector<layer>& get_layers() const { return layers; }
+
 };
 
 
@@ -28,22 +77,103 @@ class sigmanet_impl : public torch::nn::Module {
     int channels;
     int filters;
     int blocks;
+    policy_head_type policy_type;
+    block_type residual_type;
+    std::vector<int> widths;
+    bool moves_left_enabled;
 
     torch::nn::Sequential input_conv = nullptr;
     torch::nn::Sequential residual = nullptr;
     torch::nn::Sequential value_head = nullptr;
     torch::nn::Sequential policy_head = nullptr;
+    torch::nn::Sequential moves_left_head = nullptr;
+
+    torch::Tensor count_mask;
+    bool channels_last = false;
+
+    torch::Tensor decode(torch::Tensor x);
+
+    // Features of the residual tower, which the heads share.
+    torch::Tensor features(torch::Tensor x);
 
 public:
-    sigmanet_impl(int channels, int filters, int blocks);
+    // Blocks have the default width of their type unless widths are given for each of them.
+    // The moves-left head is optional, since models saved before it have none.
+    sigmanet_impl(int channels, int filters, int blocks, policy_head_type policy_type = policy_head_type::linear, block_type residual_type = block_type::basic, std::vector<int> widths = {}, bool moves_left = false);
 
     std::pair<torch::Tensor, torch::Tensor> forward(torch::Tensor x);
+
+    // Value, policy and remaining plies of the game, for training all heads in one pass. Throws std::logic_error
+    // without a moves-left head.
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> forward_moves_left(torch::Tensor x);
+
+    // Predicted number of plies until the end of the game, for each image of the batch.
+    torch::Tensor moves_left(torch::Tensor x);
+
+    int get_channels() const { return channels; }
+    int get_filters() const { return filters; }
+    int get_blocks() const { return blocks; }
+    policy_head_type get_policy_type() const { return policy_type; }
+    block_type get_block_type() const { return residual_type; }
+    const std::vector<int>& get_widths() const { return widths; }
+    bool has_moves_left() const { return moves_left_enabled; }
+
+    // Fold batch normalization into the preceding convolutions for inference. The model is put in eval mode
+    // and can not be trained or loaded into afterwards. Without folding the weights only the layers of batch
+    // normalization are removed, for weights that were folded before they were saved.
+    void fold_batchnorm(bool fold_weights = true);
+
+    // Keep convolution weights and input batches in channels-last layout, which is faster for oneDNN on the CPU.
+    void to_channels_last();
 };
 
 TORCH_MODULE_IMPL(sigmanet, sigmanet_impl);
 
 
+// Save the model along with its architecture, replacing any previous file atomically.
+void save_network(sigmanet model, const std::filesystem::path& path);
+
+// Load a model saved by save_network, or a model saved without architecture as the default of make_network.
+sigmanet load_network(const std::filesystem::path& path);
+
+
+// While alive, autocast runs convolutions and matrix products in bfloat16 on the CPU. Weights, gradients and the
+// optimizer stay in fp32. bfloat16 has the exponent range of fp32, so losses need no scaling.
+class bf16_autocast {
+
+    bool enabled;
+    bool previous_enabled;
+    at::ScalarType previous_dtype;
+
+public:
+    bf16_autocast(bool enabled = true);
+    ~bf16_autocast();
+
+    bf16_autocast(const bf16_autocast&) = delete;
+    bf16_autocast& operator=(const bf16_autocast&) = delete;
+};
+
+
+// While alive, networks are built with empty parameters instead of randomly initialised ones, for weights that
+// replace them.
+class uninitialised_parameters {
+
+    bool previous;
+
+public:
+    uninitialised_parameters();
+    ~uninitialised_parameters();
+
+    uninitialised_parameters(const uninitialised_parameters&) = delete;
+    uninitialised_parameters& operator=(const uninitialised_parameters&) = delete;
+};
+
+
 torch::Tensor sigma_loss(torch::Tensor z, torch::Tensor v, torch::Tensor pi, torch::Tensor p);
 
+// Huber loss of predicted remaining plies m against the plies that remained in the game, where they are known.
+// Unknown lengths are negative and do not count.
+torch::Tensor moves_left_loss(torch::Tensor m, torch::Tensor plies);
+
 
 #endif
\ No newline at end of file
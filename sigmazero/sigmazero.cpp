@@ -3,31 +3,37 @@
 #include <random>
 #include <chrono>
 #include <sstream>
+#include <algorithm>
+#include <thread>
 
 #include <chess/chess.hpp>
 #include <uci/uci.hpp>
 #include <torch/torch.h>
+#include <ATen/Parallel.h>
 
 #include "sigmanet.hpp"
 #include "search.hpp"
 #include "rules.hpp"
+#include "inference.hpp"
+#include "threading.hpp"
+#include "utility.hpp"
 
 
 class sigmazero: public uci::engine
 {
 private:
-    sigmanet model;
-    torch::Device device;
+    evaluator model;
+    moves_left_evaluator moves_left;
     chess::game game;
     
 public:
-    sigmazero(sigmanet model, torch::Device device):
+    sigmazero(evaluator model, moves_left_evaluator moves_left, int threads):
     uci::engine(),
     model(model),
-    device(device),
+    moves_left(moves_left),
     game()
     {
-
+        opt.add<uci::option_spin>("Threads", threads, 1, std::max<int>(threads, std::thread::hardware_concurrency()));
     }
 
     ~sigmazero()
@@ -54,6 +60,10 @@ public:
     uci::search_result search(const uci::search_limit& limit, uci::search_info& info, const std::atomic_bool& ponder, const std::atomic_bool& stop) override
     {
         long simulations = 0;
+
+        // the number of OpenMP threads is kept per thread, and each search runs in a new one
+        at::set_num_threads(opt.get<uci::option_spin>("Threads"));
+
         auto start_time = std::chrono::steady_clock::now();
 
         chess::side turn = game.get_position().get_turn();
@@ -63,6 +73,15 @@ public:
         // https://chess.stackexchange.com/questions/2506/what-is-the-average-length-of-a-game-of-chess
         int ply = game.size();
         int remaining_halfmoves = 59.3 + (72830 - 2330*ply)/(2644 + ply*(10 + ply));
+
+        if(moves_left)
+        {
+            // the prediction is for this game rather than an average one, but a few plies are always kept in reserve
+            float predicted_halfmoves = moves_left(game_image(game).unsqueeze(0))[0].item<float>();
+            remaining_halfmoves = std::max(static_cast<int>(predicted_halfmoves), 10);
+            info.message("predicted halfmoves: " + std::to_string(predicted_halfmoves));
+        }
+
         float budgeted_time = clock/remaining_halfmoves; // todo: increment
 
         info.message("budgeted time: " + std::to_string(budgeted_time));
@@ -113,7 +132,7 @@ public:
             return false;
         };
 
-        std::shared_ptr<node> best = run_mcts(game, model, device, stop_search, false);
+        std::shared_ptr<node> best = run_mcts(game, model, stop_search, false);
         std::shared_ptr<node> next = best->select_best();
 
         uci::search_result result;
@@ -134,17 +153,17 @@ int main(int argc, char** argv)
 {
     chess::init();
 
-    std::filesystem::path model_path = argc >= 2 ? argv[1] : "model.pt";
-    torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
-    sigmanet model = make_network();
+    arguments args(argc, argv);
 
-    torch::load(model, model_path);
+    thread_options threads(args);
+    configure_threads(threads);
 
-    model->to(device);
-    model->eval();
-    model->zero_grad();
+    std::filesystem::path model_path = args.positional.size() >= 1 ? args.positional[0] : "model.pt";
+    torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
+    evaluator model = load_evaluator(model_path, device, {1}, inference_options(args));
+    moves_left_evaluator moves_left = load_moves_left(model_path, device);
 
-    sigmazero engine(model, device);
+    sigmazero engine(model, moves_left, threads.intra_op > 0 ? threads.intra_op : at::get_num_threads());
     
     return uci::main(engine);
 }
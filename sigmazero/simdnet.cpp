@@ -0,0 +1,508 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMDNET_X86
+#endif
+
+#include "simdnet.hpp"
+
+
+// Activations are kept as [square][channel] on the board padded with a border of zeros, so that 3x3 convolutions
+// read neighbouring squares without bounds checks. Rows of the padded board are consecutive.
+static constexpr int padded_width = 10;
+static constexpr int padded_squares = padded_width*padded_width;
+static constexpr int squares = 64;
+
+
+static int padded(int square)
+{
+    return (square/8 + 1)*padded_width + square%8 + 1;
+}
+
+static int tap_offset(int k, int kernel_size)
+{
+    int radius = kernel_size/2;
+    return (k/kernel_size - radius)*padded_width + k%kernel_size - radius;
+}
+
+
+using conv_kernel = void (*)(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output);
+using linear_kernel = void (*)(const float* input, const simd_linear& linear, bool relu, float* output);
+
+
+// Output channels from o_begin on, the vector kernels leave the channels that do not fill a vector to this.
+static void conv_scalar(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output, int o_begin)
+{
+    const int in = conv.in_channels;
+    const int out = conv.out_channels;
+    const int taps = conv.kernel_size*conv.kernel_size;
+
+    for(int s = 0; s < squares; s++)
+    {
+        const int p = padded(s);
+
+        for(int o = o_begin; o < out; o++)
+        {
+            float sum = conv.bias[o];
+
+            for(int k = 0; k < taps; k++)
+            {
+                const float* x = input + (p + tap_offset(k, conv.kernel_size))*in;
+                const float* w = conv.weight.data() + k*in*out + o;
+
+                for(int i = 0; i < in; i++)
+                {
+                    sum += x[i]*w[i*out];
+                }
+            }
+
+            if(residual) sum += residual[p*out + o];
+            if(relu) sum = std::max(sum, 0.0f);
+
+            output[p*out + o] = sum;
+        }
+    }
+}
+
+static void linear_scalar(const float* input, const simd_linear& linear, bool relu, float* output, int o_begin)
+{
+    const int in = linear.in_features;
+    const int out = linear.out_features;
+
+    for(int o = o_begin; o < out; o++)
+    {
+        float sum = linear.bias[o];
+
+        for(int i = 0; i < in; i++)
+        {
+            sum += input[i]*linear.weight[i*out + o];
+        }
+
+        output[o] = relu ? std::max(sum, 0.0f) : sum;
+    }
+}
+
+
+static void conv_plain(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output)
+{
+    conv_scalar(input, conv, residual, relu, output, 0);
+}
+
+// Each channel by itself, with channels innermost so that the compiler vectorizes it.
+static void conv_depthwise(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output)
+{
+    const int channels = conv.out_channels;
+    const int taps = conv.kernel_size*conv.kernel_size;
+
+    for(int s = 0; s < squares; s++)
+    {
+        const int p = padded(s);
+        float* y = output + p*channels;
+
+        std::copy_n(conv.bias.data(), channels, y);
+
+        for(int k = 0; k < taps; k++)
+        {
+            const float* x = input + (p + tap_offset(k, conv.kernel_size))*channels;
+            const float* w = conv.weight.data() + k*channels;
+
+            for(int c = 0; c < channels; c++)
+            {
+                y[c] += x[c]*w[c];
+            }
+        }
+
+        for(int c = 0; c < channels; c++)
+        {
+            if(residual) y[c] += residual[p*channels + c];
+            if(relu) y[c] = std::max(y[c], 0.0f);
+        }
+    }
+}
+
+static void linear_plain(const float* input, const simd_linear& linear, bool relu, float* output)
+{
+    linear_scalar(input, linear, relu, output, 0);
+}
+
+
+#ifdef SIMDNET_X86
+
+// Tiles of 4 squares of a row by 16 output channels, so that each weight load is used for 4 squares.
+__attribute__((target("avx2,fma")))
+static void conv_avx2(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output)
+{
+    const int in = conv.in_channels;
+    const int out = conv.out_channels;
+    const int taps = conv.kernel_size*conv.kernel_size;
+    const int vector_end = out - out%16;
+
+    for(int s = 0; s < squares; s += 4)
+    {
+        const int p = padded(s);
+
+        for(int o = 0; o < vector_end; o += 16)
+        {
+            __m256 acc[4][2];
+
+            for(int j = 0; j < 4; j++)
+            {
+                acc[j][0] = _mm256_loadu_ps(conv.bias.data() + o);
+                acc[j][1] = _mm256_loadu_ps(conv.bias.data() + o + 8);
+            }
+
+            for(int k = 0; k < taps; k++)
+            {
+                const float* x = input + (p + tap_offset(k, conv.kernel_size))*in;
+                const float* w = conv.weight.data() + k*in*out + o;
+
+                for(int i = 0; i < in; i++)
+                {
+                    __m256 w0 = _mm256_loadu_ps(w + i*out);
+                    __m256 w1 = _mm256_loadu_ps(w + i*out + 8);
+
+                    for(int j = 0; j < 4; j++)
+                    {
+                        __m256 a = _mm256_broadcast_ss(x + j*in + i);
+                        acc[j][0] = _mm256_fmadd_ps(a, w0, acc[j][0]);
+                        acc[j][1] = _mm256_fmadd_ps(a, w1, acc[j][1]);
+                    }
+                }
+            }
+
+            for(int j = 0; j < 4; j++)
+            {
+                for(int h = 0; h < 2; h++)
+                {
+                    const int index = (p + j)*out + o + 8*h;
+
+                    if(residual) acc[j][h] = _mm256_add_ps(acc[j][h], _mm256_loadu_ps(residual + index));
+                    if(relu) acc[j][h] = _mm256_max_ps(acc[j][h], _mm256_setzero_ps());
+
+                    _mm256_storeu_ps(output + index, acc[j][h]);
+                }
+            }
+        }
+    }
+
+    conv_scalar(input, conv, residual, relu, output, vector_end);
+}
+
+__attribute__((target("avx2,fma")))
+static void linear_avx2(const float* input, const simd_linear& linear, bool relu, float* output)
+{
+    const int in = linear.in_features;
+    const int out = linear.out_features;
+    const int vector_end = out - out%32;
+
+    for(int o = 0; o < vector_end; o += 32)
+    {
+        __m256 acc[4];
+
+        for(int h = 0; h < 4; h++)
+        {
+            acc[h] = _mm256_loadu_ps(linear.bias.data() + o + 8*h);
+        }
+
+        for(int i = 0; i < in; i++)
+        {
+            __m256 a = _mm256_broadcast_ss(input + i);
+            const float* w = linear.weight.data() + i*out + o;
+
+            for(int h = 0; h < 4; h++)
+            {
+                acc[h] = _mm256_fmadd_ps(a, _mm256_loadu_ps(w + 8*h), acc[h]);
+            }
+        }
+
+        for(int h = 0; h < 4; h++)
+        {
+            if(relu) acc[h] = _mm256_max_ps(acc[h], _mm256_setzero_ps());
+            _mm256_storeu_ps(output + o + 8*h, acc[h]);
+        }
+    }
+
+    linear_scalar(input, linear, relu, output, vector_end);
+}
+
+
+// Tiles of a row of 8 squares by 32 output channels, there are enough registers for the accumulators.
+__attribute__((target("avx512f")))
+static void conv_avx512(const float* input, const simd_conv& conv, const float* residual, bool relu, float* output)
+{
+    const int in = conv.in_channels;
+    const int out = conv.out_channels;
+    const int taps = conv.kernel_size*conv.kernel_size;
+    const int vector_end = out - out%32;
+
+    for(int s = 0; s < squares; s += 8)
+    {
+        const int p = padded(s);
+
+        for(int o = 0; o < vector_end; o += 32)
+        {
+            __m512 acc[8][2];
+
+            for(int j = 0; j < 8; j++)
+            {
+                acc[j][0] = _mm512_loadu_ps(conv.bias.data() + o);
+                acc[j][1] = _mm512_loadu_ps(conv.bias.data() + o + 16);
+            }
+
+            for(int k = 0; k < taps; k++)
+            {
+                const float* x = input + (p + tap_offset(k, conv.kernel_size))*in;
+                const float* w = conv.weight.data() + k*in*out + o;
+
+                for(int i = 0; i < in; i++)
+                {
+                    __m512 w0 = _mm512_loadu_ps(w + i*out);
+                    __m512 w1 = _mm512_loadu_ps(w + i*out + 16);
+
+                    for(int j = 0; j < 8; j++)
+                    {
+                        __m512 a = _mm512_set1_ps(x[j*in + i]);
+                        acc[j][0] = _mm512_fmadd_ps(a, w0, acc[j][0]);
+                        acc[j][1] = _mm512_fmadd_ps(a, w1, acc[j][1]);
+                    }
+                }
+            }
+
+            for(int j = 0; j < 8; j++)
+            {
+                for(int h = 0; h < 2; h++)
+                {
+                    const int index = (p + j)*out + o + 16*h;
+
+                    if(residual) acc[j][h] = _mm512_add_ps(acc[j][h], _mm512_loadu_ps(residual + index));
+                    if(relu) acc[j][h] = _mm512_max_ps(acc[j][h], _mm512_setzero_ps());
+
+                    _mm512_storeu_ps(output + index, acc[j][h]);
+                }
+            }
+        }
+    }
+
+    conv_scalar(input, conv, residual, relu, output, vector_end);
+}
+
+__attribute__((target("avx512f")))
+static void linear_avx512(const float* input, const simd_linear& linear, bool relu, float* output)
+{
+    const int in = linear.in_features;
+    const int out = linear.out_features;
+    const int vector_end = out - out%64;
+
+    for(int o = 0; o < vector_end; o += 64)
+    {
+        __m512 acc[4];
+
+        for(int h = 0; h < 4; h++)
+        {
+            acc[h] = _mm512_loadu_ps(linear.bias.data() + o + 16*h);
+        }
+
+        for(int i = 0; i < in; i++)
+        {
+            __m512 a = _mm512_set1_ps(input[i]);
+            const float* w = linear.weight.data() + i*out + o;
+
+            for(int h = 0; h < 4; h++)
+            {
+                acc[h] = _mm512_fmadd_ps(a, _mm512_loadu_ps(w + 16*h), acc[h]);
+            }
+        }
+
+        for(int h = 0; h < 4; h++)
+        {
+            if(relu) acc[h] = _mm512_max_ps(acc[h], _mm512_setzero_ps());
+            _mm512_storeu_ps(output + o + 16*h, acc[h]);
+        }
+    }
+
+    linear_scalar(input, linear, relu, output, vector_end);
+}
+
+#endif
+
+
+struct simd_kernels
+{
+    const char* name;
+    conv_kernel conv;
+    linear_kernel linear;
+};
+
+static const simd_kernels& select_kernels()
+{
+    static const simd_kernels kernels = []() -> simd_kernels
+    {
+#ifdef SIMDNET_X86
+        __builtin_cpu_init();
+
+        if(__builtin_cpu_supports("avx512f"))
+        {
+            return {"avx512", conv_avx512, linear_avx512};
+        }
+
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return {"avx2", conv_avx2, linear_avx2};
+        }
+#endif
+        return {"scalar", conv_plain, linear_plain};
+    }();
+
+    return kernels;
+}
+
+const char* simd_instruction_set()
+{
+    return select_kernels().name;
+}
+
+
+// Buffers of a thread. A buffer is cleared when it is used with a different number of channels, so that its border
+// stays zero.
+struct simd_workspace
+{
+    std::vector<float> input;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> layers[2];
+    std::vector<float> value;
+    std::vector<float> policy;
+    std::vector<float> flat;
+    std::vector<float> hidden;
+};
+
+static float* board_buffer(std::vector<float>& buffer, int channels)
+{
+    if(buffer.size() != static_cast<std::size_t>(padded_squares*channels))
+    {
+        buffer.assign(padded_squares*channels, 0.0f);
+    }
+
+    return buffer.data();
+}
+
+static float* flat_buffer(std::vector<float>& buffer, int size)
+{
+    buffer.resize(size);
+    return buffer.data();
+}
+
+// Flattens [channel][row][column] as torch does.
+static void flatten(const float* board, int channels, float* flat)
+{
+    for(int c = 0; c < channels; c++)
+    {
+        for(int s = 0; s < squares; s++)
+        {
+            flat[c*squares + s] = board[padded(s)*channels + c];
+        }
+    }
+}
+
+
+float simdnet::evaluate(const std::uint8_t* image, float* policy) const
+{
+    thread_local simd_workspace workspace;
+    const simd_kernels& kernels = select_kernels();
+
+    const int channels = count_planes.size();
+    const int filters = input_conv.out_channels;
+
+    float* input = board_buffer(workspace.input, channels);
+    float* x = board_buffer(workspace.x, filters);
+    float* y = board_buffer(workspace.y, filters);
+
+    for(int c = 0; c < channels; c++)
+    {
+        const std::uint8_t* plane = image + c*squares;
+        float count = 0.0f;
+
+        if(count_planes[c])
+        {
+            for(int s = 0; s < squares; s++)
+            {
+                count += plane[s];
+            }
+        }
+
+        for(int s = 0; s < squares; s++)
+        {
+            input[padded(s)*channels + c] = count_planes[c] ? count : plane[s];
+        }
+    }
+
+    kernels.conv(input, input_conv, nullptr, true, x);
+
+    for(const simd_block& block: residual)
+    {
+        const float* layer_input = x;
+        const std::size_t last = block.layers.size() - 1;
+
+        for(std::size_t j = 0; j < block.layers.size(); j++)
+        {
+            const simd_conv& conv = block.layers[j].conv;
+            const conv_kernel kernel = conv.groups == 1 ? kernels.conv : conv_depthwise;
+
+            if(j == last)
+            {
+                kernel(layer_input, conv, x, true, y);
+            }
+            else
+            {
+                // layers alternate between two buffers, which are resized to their channels
+                float* layer_output = board_buffer(workspace.layers[j % 2], conv.out_channels);
+                kernel(layer_input, conv, nullptr, block.layers[j].relu, layer_output);
+                layer_input = layer_output;
+            }
+        }
+
+        std::swap(x, y);
+    }
+
+    float* value_board = board_buffer(workspace.value, value_conv.out_channels);
+    float* value_flat = flat_buffer(workspace.flat, value_hidden.in_features);
+    float* hidden = flat_buffer(workspace.hidden, value_hidden.out_features);
+    float value = 0.0f;
+
+    kernels.conv(x, value_conv, nullptr, true, value_board);
+    flatten(value_board, value_conv.out_channels, value_flat);
+    kernels.linear(value_flat, value_hidden, true, hidden);
+    kernels.linear(hidden, value_output, false, &value);
+
+    float* policy_board = board_buffer(workspace.policy, policy_conv.out_channels);
+
+    if(convolutional_policy)
+    {
+        const int actions = policy_conv.out_channels;
+
+        kernels.conv(x, policy_conv, nullptr, false, policy_board);
+
+        for(int s = 0; s < squares; s++)
+        {
+            std::copy_n(policy_board + padded(s)*actions, actions, policy + s*actions);
+        }
+    }
+    else
+    {
+        float* policy_flat = flat_buffer(workspace.flat, policy_output.in_features);
+
+        kernels.conv(x, policy_conv, nullptr, true, policy_board);
+        flatten(policy_board, policy_conv.out_channels, policy_flat);
+        kernels.linear(policy_flat, policy_output, false, policy);
+    }
+
+    return std::tanh(value);
+}
+
+int simdnet::policy_size() const
+{
+    return convolutional_policy ? squares*policy_conv.out_channels : policy_output.out_features;
+}
@@ -0,0 +1,80 @@
+#ifndef SIMDNET_HPP
+#define SIMDNET_HPP
+
+
+#include <cstdint>
+#include <vector>
+
+
+// Evaluation of a folded sigmanet one image at a time, without libtorch. Convolutions are computed directly on the
+// 8x8 board with kernels for AVX-512 and AVX2, chosen for the CPU at runtime, and a plain C++ fallback.
+
+
+struct simd_conv
+{
+    int in_channels = 0;
+    int out_channels = 0;
+    int kernel_size = 0;
+
+    // either 1, or the channels of a depthwise convolution
+    int groups = 1;
+
+    // weight[(k*in_channels/groups + i)*out_channels + o] for kernel position k, with batch normalization folded in
+    std::vector<float> weight;
+    std::vector<float> bias;
+};
+
+
+struct simd_linear
+{
+    int in_features = 0;
+    int out_features = 0;
+
+    // weight[i*out_features + o]
+    std::vector<float> weight;
+    std::vector<float> bias;
+};
+
+
+struct simd_layer
+{
+    simd_conv conv;
+    bool relu = false;
+};
+
+// The output of the last layer is added to the input of the block before the final activation.
+struct simd_block
+{
+    std::vector<simd_layer> layers;
+};
+
+
+struct simdnet
+{
+    // planes of the image that hold counts spread over the board
+    std::vector<std::uint8_t> count_planes;
+
+    simd_conv input_conv;
+    std::vector<simd_block> residual;
+
+    simd_conv value_conv;
+    simd_linear value_hidden;
+    simd_linear value_output;
+
+    // a convolutional policy head has no linear layer, its planes are the actions of each square
+    bool convolutional_policy = false;
+    simd_conv policy_conv;
+    simd_linear policy_output;
+
+    int policy_size() const;
+
+    // Evaluate an image of uint8 planes as made by game_image, writing the policy logits. Returns the value.
+    float evaluate(const std::uint8_t* image, float* policy) const;
+};
+
+
+// Instruction set of the kernels used on this CPU.
+const char* simd_instruction_set();
+
+
+#endif
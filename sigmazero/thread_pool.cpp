@@ -0,0 +1,121 @@
+#include "thread_pool.hpp"
+
+
+thread_pool::thread_pool(int threads)
+{
+    for(int i = 1; i < threads; i++)
+    {
+        this->threads.emplace_back(&thread_pool::run, this);
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    start_condition.notify_all();
+
+    for(std::thread& thread: threads)
+    {
+        thread.join();
+    }
+}
+
+
+int thread_pool::size() const
+{
+    return threads.size() + 1;
+}
+
+
+void thread_pool::parallel_for(int count, const std::function<void(int)>& function)
+{
+    if(threads.empty())
+    {
+        for(int i = 0; i < count; i++)
+        {
+            function(i);
+        }
+
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        task = &function;
+        task_count = count;
+        next_index = 0;
+        error = nullptr;
+        busy = threads.size();
+        loops++;
+    }
+
+    start_condition.notify_all();
+    work();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_condition.wait(lock, [this]{ return busy == 0; });
+    task = nullptr;
+
+    if(error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+
+void thread_pool::run()
+{
+    unsigned long loop = 0;
+
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_condition.wait(lock, [this, loop]{ return stopping || loops != loop; });
+
+            if(stopping)
+            {
+                return;
+            }
+
+            loop = loops;
+        }
+
+        work();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if(--busy == 0)
+            {
+                done_condition.notify_one();
+            }
+        }
+    }
+}
+
+
+void thread_pool::work()
+{
+    for(int i = next_index++; i < task_count; i = next_index++)
+    {
+        try
+        {
+            (*task)(i);
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if(!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Fixed threads that run the iterations of loops together with the calling thread.
+class thread_pool
+{
+public:
+    // Threads in total, including the calling thread.
+    explicit thread_pool(int threads);
+    ~thread_pool();
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int size() const;
+
+    // Call the function with each index below the count and return when all calls have. Indices are taken one at a
+    // time, so that calls may take different time. The first exception of a call is rethrown.
+    void parallel_for(int count, const std::function<void(int)>& function);
+
+private:
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+
+    const std::function<void(int)>* task = nullptr;
+    int task_count = 0;
+    std::atomic_int next_index{0};
+    std::exception_ptr error;
+
+    // threads of the pool still working on the current loop
+    int busy = 0;
+    unsigned long loops = 0;
+    bool stopping = false;
+
+    void run();
+    void work();
+};
+
+
+#endif
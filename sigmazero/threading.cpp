@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <sched.h>
+
+#include <ATen/Parallel.h>
+
+#include "threading.hpp"
+
+
+thread_options::thread_options(const arguments& args):
+intra_op(args.get<int>("intra-threads", 0)),
+inter_op(args.get<int>("interop-threads", 0)),
+cores(parse_cores(args.get<std::string>("cores", "")))
+{
+    // OpenMP counts the cores of the machine when it is loaded, before the process is pinned
+    if(intra_op == 0)
+    {
+        intra_op = cores.size();
+    }
+}
+
+
+std::vector<int> parse_cores(const std::string& list)
+{
+    std::vector<int> cores;
+    std::size_t begin = 0;
+
+    while(begin < list.size())
+    {
+        std::size_t end = list.find(',', begin);
+
+        if(end == std::string::npos)
+        {
+            end = list.size();
+        }
+
+        const std::string item = list.substr(begin, end - begin);
+        const std::size_t separator = item.find('-');
+
+        try
+        {
+            int first = std::stoi(item.substr(0, separator));
+            int last = separator == std::string::npos ? first : std::stoi(item.substr(separator + 1));
+
+            if(first < 0 || last < first || last >= CPU_SETSIZE)
+            {
+                throw std::out_of_range(item);
+            }
+
+            for(int core = first; core <= last; core++)
+            {
+                cores.push_back(core);
+            }
+        }
+        catch(const std::logic_error& e)
+        {
+            throw std::invalid_argument("invalid cores " + item);
+        }
+
+        begin = end + 1;
+    }
+
+    return cores;
+}
+
+
+std::vector<int> affinity_cores()
+{
+    std::vector<int> cores;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        return cores;
+    }
+
+    for(int core = 0; core < CPU_SETSIZE; core++)
+    {
+        if(CPU_ISSET(core, &set))
+        {
+            cores.push_back(core);
+        }
+    }
+
+    return cores;
+}
+
+
+std::pair<thread_options, thread_options> split_cores(const thread_options& options, int count)
+{
+    const std::vector<int> cores = options.cores.empty() ? affinity_cores() : options.cores;
+
+    if(count <= 0 || count >= static_cast<int>(cores.size()))
+    {
+        throw std::invalid_argument("can not split " + std::to_string(count) + " of " + std::to_string(cores.size()) + " cores");
+    }
+
+    // intra-op threads left to the default are as many as the cores
+    const int intra_op = options.intra_op > 0 ? options.intra_op : cores.size();
+
+    thread_options first = options;
+    thread_options rest = options;
+
+    first.cores.assign(cores.begin(), cores.begin() + count);
+    rest.cores.assign(cores.begin() + count, cores.end());
+
+    first.intra_op = std::min<int>(intra_op, first.cores.size());
+    rest.intra_op = std::min<int>(intra_op, rest.cores.size());
+
+    return {first, rest};
+}
+
+
+void configure_threads(const thread_options& options)
+{
+    // only the calling thread is pinned, threads inherit it when started
+    configure_thread(options);
+
+    if(options.inter_op > 0)
+    {
+        try
+        {
+            at::set_num_interop_threads(options.inter_op);
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "setting inter-op threads failed: " << e.what() << std::endl;
+        }
+    }
+
+    std::cerr << "using " << at::get_num_threads() << " intra-op and " << at::get_num_interop_threads() << " inter-op threads";
+
+    if(!options.cores.empty())
+    {
+        std::cerr << " on " << options.cores.size() << " cores";
+    }
+
+    std::cerr << std::endl;
+}
+
+
+void configure_thread(const thread_options& options)
+{
+    if(!options.cores.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for(int core: options.cores)
+        {
+            CPU_SET(core, &set);
+        }
+
+        if(sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            std::cerr << "pinning to cores failed" << std::endl;
+        }
+    }
+
+    if(options.intra_op > 0)
+    {
+        at::set_num_threads(options.intra_op);
+    }
+}
+
+
+job_thread::job_thread(const thread_options& options):
+thread(&job_thread::run, this, options)
+{
+}
+
+job_thread::~job_thread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    condition.notify_one();
+    thread.join();
+}
+
+
+void job_thread::run(const thread_options& options)
+{
+    configure_thread(options);
+
+    while(true)
+    {
+        std::function<void()> job;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]{ return stopping || !jobs.empty(); });
+
+            if(jobs.empty())
+            {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job();
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef THREADING_HPP
+#define THREADING_HPP
+
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utility.hpp"
+
+
+// Threads of libtorch and the cores that a process runs on. OpenMP starts a thread for every core of the machine by
+// default, so processes that share a machine oversubscribe it unless they are given disjoint cores.
+struct thread_options
+{
+    // Threads that split the work of an operator, such as a convolution, or zero for the default of libtorch.
+    int intra_op = 0;
+
+    // Threads that run independent operators of TorchScript graphs, or zero for the default of libtorch.
+    int inter_op = 0;
+
+    // Cores to run on, or all cores if empty.
+    std::vector<int> cores;
+
+    thread_options() = default;
+
+    // Options --intra-threads, --interop-threads and --cores. Intra-op threads default to the number of cores given.
+    thread_options(const arguments& args);
+};
+
+
+// Cores of a list of cores and ranges such as 0-7,16. Throws std::invalid_argument if the list can not be parsed.
+std::vector<int> parse_cores(const std::string& list);
+
+// Cores that the calling thread may run on.
+std::vector<int> affinity_cores();
+
+// Options of threads on the first count cores of the options and of threads on the rest, with intra-op threads limited
+// to the cores of each. Without cores in the options, the cores the calling thread may run on are split. Throws
+// std::invalid_argument unless both get some cores.
+std::pair<thread_options, thread_options> split_cores(const thread_options& options, int count);
+
+// Pin the process to its cores and size the thread pools of libtorch. Call it first in main, so that threads started
+// afterwards inherit the cores, and before libtorch starts its inter-op pool, which can only be sized before.
+void configure_threads(const thread_options& options);
+
+// Pin the calling thread to the cores and set its intra-op threads, where given. OpenMP keeps the number of threads
+// per thread, so a thread that runs libtorch uses the default of the machine unless it is set on that thread.
+void configure_thread(const thread_options& options);
+
+
+// Thread that runs jobs one at a time in the order they were submitted, configured once with the options of its
+// threads. Remaining jobs are run before it stops.
+class job_thread
+{
+public:
+    explicit job_thread(const thread_options& options);
+    ~job_thread();
+
+    job_thread(const job_thread&) = delete;
+    job_thread& operator=(const job_thread&) = delete;
+
+    // Run the function on the thread, with its result or exception in the future.
+    template<typename Function>
+    std::future<std::invoke_result_t<Function>> submit(Function function);
+
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+
+    std::thread thread;
+
+    void run(const thread_options& options);
+};
+
+
+template<typename Function>
+std::future<std::invoke_result_t<Function>> job_thread::submit(Function function)
+{
+    // jobs are copyable, so the task is shared
+    auto job = std::make_shared<std::packaged_task<std::invoke_result_t<Function>()>>(std::move(function));
+    std::future<std::invoke_result_t<Function>> result = job->get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back([job]() { (*job)(); });
+    }
+
+    condition.notify_one();
+
+    return result;
+}
+
+
+#endif
@@ -14,6 +14,10 @@
 #include <vector>
 #include <queue>
 #include <iomanip>
+#include <chrono>
+#include <tuple>
+#include <optional>
+#include <variant>
 
 #include <chess/chess.hpp>
 #include <torch/torch.h>
@@ -21,44 +25,85 @@
 #include "sigmanet.hpp"
 #include "rules.hpp"
 #include "sync_queue.hpp"
-#include "base64.hpp"
+#include "inference.hpp"
+#include "utility.hpp"
+#include "replay.hpp"
+#include "threading.hpp"
 
 
-struct replay_position
+static void replay_receiver(std::istream& stream, sync_queue<replay_position>& queue, sync_queue<replay_game>& game_queue)
 {
-	torch::Tensor image, value, policy; 
-};
+	while(true)
+	{
+		try
+		{
+			std::optional<replay_record> record = read_record(stream);
 
+			if(!record)
+			{
+				break;
+			}
 
-static torch::Tensor decode(const std::string& data)
-{
-    torch::Tensor tensor;
-    std::istringstream stream(base64_decode(data));
-    torch::load(tensor, stream);
-    return tensor;
+			if(std::holds_alternative<replay_position>(*record))
+			{
+				queue.push(std::get<replay_position>(std::move(*record)));
+			}
+			else
+			{
+				// rendering images is left to the ingest threads, to keep up with the stream
+				game_queue.push(std::get<replay_game>(std::move(*record)));
+			}
+		}
+		catch(const std::exception& e)
+		{
+			std::cerr << "exception raised when receiving replay, ignoring it..." << std::endl;
+		}
+	}
+
+	std::cerr << "one replay stream was closed unexpectedly" << std::endl;
 }
 
 
-static void replay_receiver(std::istream& stream, sync_queue<replay_position>& queue)
+static void replay_ingester(sync_queue<replay_game>& game_queue, sync_queue<replay_position>& queue)
 {
-	std::string encoded_replay;
-	while(std::getline(stream, encoded_replay))
+	while(true)
 	{
+		replay_game game = game_queue.pop();
+
 		try
 		{
-			std::string encoded_image, encoded_value, encoded_policy;
-			std::istringstream(encoded_replay) >> encoded_image >> encoded_value >> encoded_policy;
-			replay_position replay{decode(encoded_image), decode(encoded_value), decode(encoded_policy)};
-		
-			queue.push(replay);
+			for(replay_position& replay: replay_positions(game))
+			{
+				queue.push(std::move(replay));
+			}
 		}
 		catch(const std::exception& e)
 		{
-			std::cerr << "exception raised when receiving replay, ignoring it..." << std::endl;
+			std::cerr << "exception raised when replaying game, ignoring it..." << std::endl;
 		}
 	}
+}
 
-	std::cerr << "one replay stream was closed unexpectedly" << std::endl;
+
+// Load the model at the path, or create and save one with the architecture given by the options with the prefix.
+static sigmanet load_or_create(const std::filesystem::path& path, const arguments& args, const std::string& prefix, int filters, int blocks)
+{
+	if(std::filesystem::exists(path))
+	{
+		std::cerr << "loaded existing model " << path << std::endl;
+		return load_network(path);
+	}
+
+	// architecture of a new model, which is saved with it
+	policy_head_type policy_type = policy_head_of(args.get<std::string>(prefix + "policy-head", "linear"));
+	block_type residual_type = block_type_of(args.get<std::string>(prefix + "block", "basic"));
+	bool moves_left = args.has(prefix + "moves-left");
+	sigmanet model = make_network(2, args.get<int>(prefix + "filters", filters), args.get<int>(prefix + "blocks", blocks), policy_type, residual_type, moves_left);
+
+	save_network(model, path);
+	std::cerr << "saved initial model " << path << std::endl;
+
+	return model;
 }
 
 
@@ -70,35 +115,51 @@ int main(int argc, char** argv)
 	const unsigned epoch_batches = 1024;	// save after this number of batches
 	const unsigned checkpoint_epochs = 64;	// checkpoint after this number of saves
 
-	if(argc < 2)
+	const long quantization_samples = 256;	// window positions to calibrate and check the quantized model with
+
+	arguments args(argc, argv);
+
+	chess::init();
+
+	const bool bf16 = args.has("bf16");	// forward and backward in bfloat16 on the CPU
+
+	// replay receivers are started later and share the cores
+	configure_threads(thread_options(args));
+
+	if(args.positional.size() < 1)
 	{
 		std::cerr << "missing model path" << std::endl;
 		return 1;
 	}
 	else
 	{
-		std::cerr << "using model path " << argv[1] << std::endl;
+		std::cerr << "using model path " << args.positional[0] << std::endl;
 	}
 
 	// setup initial model
-	std::filesystem::path model_path(argv[1]);
+	std::filesystem::path model_path(args.positional[0]);
 	
-	sigmanet model = make_network();
+	sigmanet model = load_or_create(model_path, args, "", 128, 10);
 
-	if(std::filesystem::exists(model_path))
+	// smaller model distilled from the outputs of the model, for faster search
+	std::filesystem::path student_path(args.get<std::string>("student", ""));
+	sigmanet student = nullptr;
+
+	if(args.has("student") && student_path.empty())
 	{
-		torch::load(model, model_path);
-		std::cerr << "loaded existing model" << std::endl;
+		std::cerr << "missing student path, pass --student=path" << std::endl;
+		return 1;
 	}
-	else
+
+	if(!student_path.empty())
 	{
-		torch::save(model, model_path);
-		std::cerr << "saved initial model" << std::endl;
+		student = load_or_create(student_path, args, "student-", 64, 6);
 	}
 	
 	// receive selfplay replays
-	std::vector<std::ifstream> replay_files(argv+2, argv+argc);
+	std::vector<std::ifstream> replay_files(args.positional.begin()+1, args.positional.end());
 	sync_queue<replay_position> replay_queue;
+	sync_queue<replay_game> game_queue;
 	std::vector<std::reference_wrapper<std::istream>> replay_streams(replay_files.begin(), replay_files.end());
 	std::vector<std::thread> replay_threads;
 
@@ -113,7 +174,15 @@ int main(int argc, char** argv)
 	for(std::istream& replay_stream: replay_streams)
 	{
 		// one thread per stream is ok since they will mostly be blocked
-		replay_threads.emplace_back(replay_receiver, std::ref(replay_stream), std::ref(replay_queue));
+		replay_threads.emplace_back(replay_receiver, std::ref(replay_stream), std::ref(replay_queue), std::ref(game_queue));
+	}
+
+	// render the positions of game records
+	const int ingest_threads = args.get<int>("ingest-threads", 2);
+
+	for(int i = 0; i < ingest_threads; i++)
+	{
+		replay_threads.emplace_back(replay_ingester, std::ref(game_queue), std::ref(replay_queue));
 	}
 
 	// check cuda support
@@ -130,6 +199,33 @@ int main(int argc, char** argv)
 
 	model->train();
 	model->to(device);
+
+	if(args.has("channels-last"))
+	{
+		model->to_channels_last();
+		std::cerr << "using channels-last layout" << std::endl;
+	}
+
+	if(bf16)
+	{
+		std::cerr << "using bfloat16 autocast" << std::endl;
+	}
+
+	std::unique_ptr<torch::optim::AdamW> student_optimizer;
+
+	if(student)
+	{
+		student->train();
+		student->to(device);
+
+		if(args.has("channels-last"))
+		{
+			student->to_channels_last();
+		}
+
+		student_optimizer = std::make_unique<torch::optim::AdamW>(student->parameters(), torch::optim::AdamWOptions().weight_decay(0.0001));
+		std::cerr << "distilling student " << student_path << std::endl;
+	}
 	
 	torch::optim::AdamW optimizer(model->parameters(), torch::optim::AdamWOptions().weight_decay(0.0001));
 	//torch::optim::Adam optimizer(model->parameters(), torch::optim::AdamOptions().weight_decay(0.0001));
@@ -142,10 +238,13 @@ int main(int argc, char** argv)
 	torch::Tensor window_images;
 	torch::Tensor window_values;
 	torch::Tensor window_policies;
+	torch::Tensor window_moves_left;
 
 	unsigned batches_since_epoch = 0;
 	unsigned epochs_since_checkpoint = 0;
 	float epoch_running_loss = 0.0f;
+	float epoch_student_loss = 0.0f;
+	std::chrono::steady_clock::time_point epoch_start;
 
 	bool first_replay = true;
 
@@ -162,10 +261,12 @@ int main(int argc, char** argv)
 		std::vector<torch::Tensor> replay_images;
 		std::vector<torch::Tensor> replay_values;
 		std::vector<torch::Tensor> replay_policies;
+		std::vector<torch::Tensor> replay_moves_left;
 
 		replay_images.reserve(incoming_replays);
 		replay_values.reserve(incoming_replays);
 		replay_policies.reserve(incoming_replays);
+		replay_moves_left.reserve(incoming_replays);
 
 		while(replay_queue.size())
 		{
@@ -181,6 +282,7 @@ int main(int argc, char** argv)
 			replay_images.push_back(replay.image);
 			replay_values.push_back(replay.value);
 			replay_policies.push_back(replay.policy);
+			replay_moves_left.push_back(replay.moves_left);
 
 			received++;
 			shifted++;
@@ -197,12 +299,14 @@ int main(int argc, char** argv)
 				window_images = torch::stack(replay_images);
 				window_values = torch::stack(replay_values);
 				window_policies = torch::stack(replay_policies);
+				window_moves_left = torch::stack(replay_moves_left);
 			}
 			else
 			{
 				window_images = torch::cat({window_images, torch::stack(replay_images)});
 				window_values = torch::cat({window_values, torch::stack(replay_values)});
 				window_policies = torch::cat({window_policies, torch::stack(replay_policies)});
+				window_moves_left = torch::cat({window_moves_left, torch::stack(replay_moves_left)});
 			}
 		}
 
@@ -218,6 +322,13 @@ int main(int argc, char** argv)
 		window_images = window_images.index({window_slice});
 		window_values = window_values.index({window_slice});
 		window_policies = window_policies.index({window_slice});
+		window_moves_left = window_moves_left.index({window_slice});
+
+		// the steps of an epoch are timed from its first one, without filling the window or publishing
+		if(batches_since_epoch == 0)
+		{
+			epoch_start = std::chrono::steady_clock::now();
+		}
 
 		// sample batch of replays
 		torch::Tensor batch_sample = torch::randint(window_size, {batch_size}).to(torch::kLong);
@@ -225,30 +336,179 @@ int main(int argc, char** argv)
 		torch::Tensor batch_images = window_images.index({batch_sample}).to(device);
 		torch::Tensor batch_values = window_values.index({batch_sample}).to(device);
 		torch::Tensor batch_policies = window_policies.index({batch_sample}).to(device);
+		torch::Tensor batch_moves_left = window_moves_left.index({batch_sample}).to(device);
 
 		//std::cerr << "batch ready" << std::endl;
 		// train on batch
 		model->zero_grad();
-		auto [value, policy] = model->forward(batch_images);
+		torch::Tensor value, policy, moves_left;
+		{
+			bf16_autocast autocast(bf16);
+
+			if(model->has_moves_left())
+			{
+				std::tie(value, policy, moves_left) = model->forward_moves_left(batch_images);
+			}
+			else
+			{
+				std::tie(value, policy) = model->forward(batch_images);
+			}
+		}
 		//std::cerr << "distribution label: " << batch_policies << std::endl;
-		auto loss = sigma_loss(value, batch_values, policy, batch_policies);
+		auto loss = sigma_loss(value.to(torch::kFloat), batch_values, policy.to(torch::kFloat), batch_policies);
+
+		if(moves_left.defined())
+		{
+			loss = loss + moves_left_loss(moves_left.to(torch::kFloat), batch_moves_left);
+		}
+
 		loss.backward();
 		optimizer.step();
 
+		if(student)
+		{
+			// outputs of the model on the batch are soft targets of the student
+			torch::Tensor teacher_values = value.detach().to(torch::kFloat).flatten();
+			torch::Tensor teacher_policies = torch::softmax(policy.detach().to(torch::kFloat), -1);
+
+			student->zero_grad();
+			torch::Tensor student_value, student_policy, student_moves_left;
+			{
+				bf16_autocast autocast(bf16);
+
+				if(student->has_moves_left())
+				{
+					std::tie(student_value, student_policy, student_moves_left) = student->forward_moves_left(batch_images);
+				}
+				else
+				{
+					std::tie(student_value, student_policy) = student->forward(batch_images);
+				}
+			}
+
+			auto student_loss = sigma_loss(student_value.to(torch::kFloat), teacher_values, student_policy.to(torch::kFloat), teacher_policies);
+
+			// game lengths are known targets, so the student learns them from the replays
+			if(student_moves_left.defined())
+			{
+				student_loss = student_loss + moves_left_loss(student_moves_left.to(torch::kFloat), batch_moves_left);
+			}
+			student_loss.backward();
+			student_optimizer->step();
+
+			epoch_student_loss += student_loss.item<float>();
+		}
+
 		consumed += batch_size;
 		epoch_running_loss += loss.item<float>();
 
 		// update model
 		if(++batches_since_epoch == epoch_batches)
 		{
-			std::cerr << "epoch: " << epoch_running_loss/epoch_batches << " average loss, " << epoch_running_loss << " running loss, " << epochs_since_checkpoint << "/" << checkpoint_epochs << " to checkpoint" << std::endl;
+			std::chrono::duration<double> epoch_time = std::chrono::steady_clock::now() - epoch_start;
+
+			std::cerr << "epoch: " << epoch_running_loss/epoch_batches << " average loss, " << epoch_running_loss << " running loss, " << epoch_batches/epoch_time.count() << " steps/s, " << epochs_since_checkpoint << "/" << checkpoint_epochs << " to checkpoint" << std::endl;
+
+			if(bf16)
+			{
+				// loss of the last batch with and without autocast, in eval mode to leave batch statistics alone
+				torch::NoGradGuard no_grad;
+				model->eval();
+
+				auto parity_loss = [&](bool enabled)
+				{
+					bf16_autocast autocast(enabled);
+					auto [value, policy] = model->forward(batch_images);
+					return sigma_loss(value.to(torch::kFloat), batch_values, policy.to(torch::kFloat), batch_policies).item<float>();
+				};
+
+				float fp32_loss = parity_loss(false);
+				std::cerr << "bf16 parity: " << parity_loss(true)/batch_size << " bf16 loss, " << fp32_loss/batch_size << " fp32 loss per position" << std::endl;
+
+				model->train();
+			}
 			
+			if(student)
+			{
+				std::cerr << "student: " << epoch_student_loss/epoch_batches << " average distillation loss" << std::endl;
+				epoch_student_loss = 0.0f;
+
+				save_network(student, student_path);
+				std::cerr << "saved student " << student_path << std::endl;
+
+				try
+				{
+					publish_weights(student_path);
+					publish_script(student_path);
+				}
+				catch(const std::exception& e)
+				{
+					std::cerr << "scripting student failed: " << e.what() << std::endl;
+				}
+
+				try
+				{
+					publish_manifest(student_path);
+				}
+				catch(const std::exception& e)
+				{
+					std::cerr << "publishing student failed: " << e.what() << std::endl;
+				}
+			}
+
 			epoch_running_loss = 0.0f;
 			batches_since_epoch = 0;
 
-			torch::save(model, model_path);
+			save_network(model, model_path);
 			std::cerr << "saved model " << model_path << std::endl;
 
+			try
+			{
+				publish_weights(model_path);
+				std::cerr << "saved weights " << weights_path(model_path) << std::endl;
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "saving weights failed: " << e.what() << std::endl;
+			}
+
+			try
+			{
+				publish_script(model_path);
+				std::cerr << "saved scripted model " << script_path(model_path) << std::endl;
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "scripting model failed: " << e.what() << std::endl;
+			}
+
+			try
+			{
+				// calibrate and check on disjoint samples
+				using torch::indexing::Slice;
+				torch::Tensor samples = torch::randperm(window_size).index({Slice(0, 2*quantization_samples)});
+				torch::Tensor calibration_images = window_images.index({samples.index({Slice(0, quantization_samples)})});
+				torch::Tensor check_images = window_images.index({samples.index({Slice(quantization_samples)})});
+
+				evaluation_error error = publish_quantized(model_path, calibration_images, check_images);
+				std::cerr << "saved quantized model " << quantized_path(model_path) << ": " << error.value_mse << " value mse, " << error.policy_kl << " policy kl" << std::endl;
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "quantizing model failed: " << e.what() << std::endl;
+			}
+
+			// selfplay loads the model and its published files once they are all written
+			try
+			{
+				publish_manifest(model_path);
+				std::cerr << "saved manifest " << manifest_path(model_path) << std::endl;
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "publishing model failed: " << e.what() << std::endl;
+			}
+
 			if(++epochs_since_checkpoint == checkpoint_epochs)
 			{
 				epochs_since_checkpoint = 0;
@@ -3,7 +3,8 @@
 
 std::mt19937& get_generator()
 {
-    static std::mt19937 generator = std::mt19937(std::random_device{}());
+    // one for each thread, so that threads do not share its state
+    thread_local std::mt19937 generator = std::mt19937(std::random_device{}());
     return generator;
 }
 
@@ -12,3 +13,47 @@ std::ostream& log(std::string_view type)
 {
     return std::cerr << type << ": ";
 }
+
+
+arguments::arguments(int argc, char** argv)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+
+        if(argument.rfind("--", 0) == 0)
+        {
+            std::size_t separator = argument.find('=');
+            std::string name = argument.substr(2, separator - 2);
+            options[name] = separator == std::string::npos ? "" : argument.substr(separator + 1);
+        }
+        else
+        {
+            positional.push_back(argument);
+        }
+    }
+}
+
+
+bool arguments::has(const std::string& name) const
+{
+    return options.contains(name);
+}
+
+
+void arguments::add_defaults(std::istream& stream)
+{
+    std::string line;
+
+    while(std::getline(stream, line))
+    {
+        if(line.rfind("--", 0) != 0)
+        {
+            continue;
+        }
+
+        std::size_t separator = line.find('=');
+        std::string name = line.substr(2, separator - 2);
+        options.try_emplace(name, separator == std::string::npos ? "" : line.substr(separator + 1));
+    }
+}
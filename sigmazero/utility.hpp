@@ -1,10 +1,72 @@
+#ifndef UTILITY_HPP
+#define UTILITY_HPP
+
 #include <random>
 #include <iostream>
+#include <istream>
 #include <string>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include <unordered_map>
 
 
+// Generator of the calling thread.
 std::mt19937& get_generator();
 
 
 std::ostream& log(std::string_view type);
 
+
+// Command line of positional arguments and options given as --name or --name=value.
+struct arguments
+{
+    std::vector<std::string> positional;
+    std::unordered_map<std::string, std::string> options;
+
+    arguments(int argc, char** argv);
+
+    // Add options from lines of --name or --name=value, unless they were given on the command line. Empty lines and
+    // lines starting with # are skipped.
+    void add_defaults(std::istream& stream);
+
+    bool has(const std::string& name) const;
+
+    // The value of the option, or the default when it was not given. Throws std::invalid_argument when the value is
+    // missing or is not entirely a T.
+    template<typename T>
+    T get(const std::string& name, T default_value) const;
+};
+
+
+template<typename T>
+T arguments::get(const std::string& name, T default_value) const
+{
+    auto it = options.find(name);
+
+    if(it == options.end())
+    {
+        return default_value;
+    }
+
+    if constexpr(std::is_same_v<T, std::string>)
+    {
+        return it->second;
+    }
+    else
+    {
+        T value;
+        std::istringstream in(it->second);
+
+        if(!(in >> value) || in.peek() != std::istringstream::traits_type::eof())
+        {
+            throw std::invalid_argument("invalid value '" + it->second + "' for option --" + name);
+        }
+
+        return value;
+    }
+}
+
+
+#endif
@@ -0,0 +1,268 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "weights.hpp"
+
+
+static const char magic[8] = {'s', 'i', 'g', 'm', 'a', 'w', 't', 's'};
+// version 1 has no moves-left field, which is read as absent
+static const std::uint32_t version = 2;
+static const std::uint64_t alignment = 64;
+
+
+template<typename T>
+static void put(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Reads a value at the position of a header, checking that it is within the file.
+template<typename T>
+static T get(const char*& position, const char* end)
+{
+    if(end - position < static_cast<std::ptrdiff_t>(sizeof(T)))
+    {
+        throw std::runtime_error("weight file is truncated");
+    }
+
+    T value;
+    std::memcpy(&value, position, sizeof(T));
+    position += sizeof(T);
+
+    return value;
+}
+
+
+mapped_weights::mapped_weights(const std::filesystem::path& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if(fd < 0)
+    {
+        throw std::runtime_error("can not open weight file " + path.string());
+    }
+
+    struct stat status;
+
+    if(::fstat(fd, &status) < 0 || status.st_size == 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("can not read weight file " + path.string());
+    }
+
+    size = status.st_size;
+    address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // the mapping keeps the file alive after it is closed, even if it is replaced
+    ::close(fd);
+
+    if(address == MAP_FAILED)
+    {
+        address = nullptr;
+        throw std::runtime_error("can not map weight file " + path.string());
+    }
+
+    try
+    {
+        const char* begin = static_cast<const char*>(address);
+        const char* end = begin + size;
+        const char* position = begin;
+
+        if(size < sizeof(magic) || std::memcmp(position, magic, sizeof(magic)) != 0)
+        {
+            throw std::runtime_error("not a weight file");
+        }
+
+        position += sizeof(magic);
+
+        std::uint32_t file_version = get<std::uint32_t>(position, end);
+
+        if(file_version < 1 || file_version > version)
+        {
+            throw std::runtime_error("unsupported weight file version");
+        }
+
+        header.dtype = static_cast<weights_dtype>(get<std::uint32_t>(position, end));
+
+        if(header.dtype != weights_dtype::float32)
+        {
+            throw std::runtime_error("unsupported weight file dtype");
+        }
+
+        header.history = get<std::int32_t>(position, end);
+        header.channels = get<std::int32_t>(position, end);
+        header.filters = get<std::int32_t>(position, end);
+        header.blocks = get<std::int32_t>(position, end);
+        header.policy_head = get<std::int32_t>(position, end);
+        header.block_type = get<std::int32_t>(position, end);
+
+        if(file_version >= 2)
+        {
+            header.moves_left = get<std::int32_t>(position, end);
+        }
+
+        for(int i = 0; i < header.blocks; i++)
+        {
+            header.widths.push_back(get<std::int32_t>(position, end));
+        }
+
+        std::uint32_t count = get<std::uint32_t>(position, end);
+
+        for(std::uint32_t i = 0; i < count; i++)
+        {
+            std::uint32_t name_length = get<std::uint32_t>(position, end);
+
+            if(end - position < static_cast<std::ptrdiff_t>(name_length))
+            {
+                throw std::runtime_error("weight file is truncated");
+            }
+
+            std::string name(position, name_length);
+            position += name_length;
+
+            weight_tensor tensor;
+            std::uint32_t dimensions = get<std::uint32_t>(position, end);
+            std::uint64_t elements = 1;
+
+            for(std::uint32_t d = 0; d < dimensions; d++)
+            {
+                tensor.shape.push_back(get<std::int64_t>(position, end));
+                elements *= tensor.shape.back();
+            }
+
+            std::uint64_t offset = get<std::uint64_t>(position, end);
+
+            if(offset % alignment != 0 || offset > size || elements*sizeof(float) > size - offset)
+            {
+                throw std::runtime_error("tensor " + name + " is outside of the weight file");
+            }
+
+            tensor.data = reinterpret_cast<const float*>(begin + offset);
+            table.emplace(name, tensor);
+        }
+    }
+    catch(const std::runtime_error& e)
+    {
+        ::munmap(address, size);
+        throw std::runtime_error(std::string(e.what()) + ": " + path.string());
+    }
+}
+
+mapped_weights::~mapped_weights()
+{
+    if(address)
+    {
+        ::munmap(address, size);
+    }
+}
+
+const weight_tensor& mapped_weights::tensor(const std::string& name) const
+{
+    auto it = table.find(name);
+
+    if(it == table.end())
+    {
+        throw std::out_of_range("missing tensor " + name + " in weight file");
+    }
+
+    return it->second;
+}
+
+
+static std::uint64_t aligned(std::uint64_t offset)
+{
+    return (offset + alignment - 1)/alignment*alignment;
+}
+
+static std::uint64_t elements(const weight_tensor& tensor)
+{
+    std::uint64_t count = 1;
+
+    for(std::int64_t size: tensor.shape)
+    {
+        count *= size;
+    }
+
+    return count;
+}
+
+
+void write_weights(const std::filesystem::path& path, const weights_architecture& architecture, const std::vector<std::pair<std::string, weight_tensor>>& tensors)
+{
+    std::string header(magic, sizeof(magic));
+
+    put<std::uint32_t>(header, version);
+    put<std::uint32_t>(header, static_cast<std::uint32_t>(architecture.dtype));
+    put<std::int32_t>(header, architecture.history);
+    put<std::int32_t>(header, architecture.channels);
+    put<std::int32_t>(header, architecture.filters);
+    put<std::int32_t>(header, architecture.blocks);
+    put<std::int32_t>(header, architecture.policy_head);
+    put<std::int32_t>(header, architecture.block_type);
+    put<std::int32_t>(header, architecture.moves_left);
+
+    for(int width: architecture.widths)
+    {
+        put<std::int32_t>(header, width);
+    }
+
+    put<std::uint32_t>(header, tensors.size());
+
+    // the size of the table is known before the offsets are
+    std::uint64_t table_size = 0;
+
+    for(const auto& [name, tensor]: tensors)
+    {
+        table_size += sizeof(std::uint32_t) + name.size() + sizeof(std::uint32_t) + tensor.shape.size()*sizeof(std::int64_t) + sizeof(std::uint64_t);
+    }
+
+    std::uint64_t offset = aligned(header.size() + table_size);
+    std::vector<std::uint64_t> offsets;
+
+    for(const auto& [name, tensor]: tensors)
+    {
+        put<std::uint32_t>(header, name.size());
+        header.append(name);
+        put<std::uint32_t>(header, tensor.shape.size());
+
+        for(std::int64_t size: tensor.shape)
+        {
+            put<std::int64_t>(header, size);
+        }
+
+        put<std::uint64_t>(header, offset);
+        offsets.push_back(offset);
+
+        offset = aligned(offset + elements(tensor)*sizeof(float));
+    }
+
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        file.write(header.data(), header.size());
+
+        for(std::size_t i = 0; i < tensors.size(); i++)
+        {
+            // zeros up to the aligned offset of the tensor
+            std::string padding(offsets[i] - static_cast<std::uint64_t>(file.tellp()), '\0');
+            file.write(padding.data(), padding.size());
+            file.write(reinterpret_cast<const char*>(tensors[i].second.data), elements(tensors[i].second)*sizeof(float));
+        }
+
+        if(!file)
+        {
+            throw std::runtime_error("can not write weight file " + temporary_path.string());
+        }
+    }
+
+    // readers never see a partially written file, and keep their mapping of the previous one
+    std::filesystem::rename(temporary_path, path);
+}
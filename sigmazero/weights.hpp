@@ -0,0 +1,75 @@
+#ifndef WEIGHTS_HPP
+#define WEIGHTS_HPP
+
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Flat weight files hold a header with the architecture and a table of named tensors, followed by the data of the
+// tensors aligned to 64 bytes. Files are memory mapped read-only, so that tensors wrap the data without copying it and
+// processes that load the same file share its pages. Numbers are stored in the byte order of the host.
+
+
+enum class weights_dtype : std::uint32_t
+{
+    float32 = 0
+};
+
+
+struct weights_architecture
+{
+    int history = 0;
+    int channels = 0;
+    int filters = 0;
+    int blocks = 0;
+    int policy_head = 0;
+    int block_type = 0;
+    int moves_left = 0;
+    weights_dtype dtype = weights_dtype::float32;
+
+    std::vector<int> widths;
+};
+
+
+struct weight_tensor
+{
+    std::vector<std::int64_t> shape;
+    const float* data = nullptr;
+};
+
+
+class mapped_weights
+{
+    void* address = nullptr;
+    std::size_t size = 0;
+
+    weights_architecture header;
+    std::map<std::string, weight_tensor> table;
+
+public:
+    // Throws std::runtime_error if the file can not be mapped or is not a valid weight file.
+    explicit mapped_weights(const std::filesystem::path& path);
+    ~mapped_weights();
+
+    mapped_weights(const mapped_weights&) = delete;
+    mapped_weights& operator=(const mapped_weights&) = delete;
+
+    const weights_architecture& architecture() const { return header; }
+
+    const std::map<std::string, weight_tensor>& tensors() const { return table; }
+
+    // Throws std::out_of_range if there is no tensor with the name.
+    const weight_tensor& tensor(const std::string& name) const;
+};
+
+
+// Write a weight file, replacing any previous file at the path atomically.
+void write_weights(const std::filesystem::path& path, const weights_architecture& architecture, const std::vector<std::pair<std::string, weight_tensor>>& tensors);
+
+
+#endif